@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "array.h"
 
 #define ARRAY_RAW_DATA(array) ((int *)(array) - 2)
@@ -40,10 +41,128 @@ int array_length(void *array)
     return (array != NULL) ? ARRAY_OCCUPIED(array) : 0;
 }
 
+void array_truncate(void *array, int count)
+{
+    if (array != NULL && count < ARRAY_OCCUPIED(array))
+    {
+        ARRAY_OCCUPIED(array) = count;
+    }
+}
+
 void array_free(void *array)
 {
     if (array != NULL)
     {
         free(ARRAY_RAW_DATA(array));
     }
-}
\ No newline at end of file
+}
+
+void *array_init_header(void *header, int count)
+{
+    int *base = (int *)header;
+    base[0] = count; // capacity
+    base[1] = count; // occupied
+    return base + 2;
+}
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+// Overflow blocks are chained through a header placed in front of their data
+typedef struct arena_overflow
+{
+    struct arena_overflow *next;
+    char padding[ARENA_ALIGNMENT - sizeof(void *)];
+} arena_overflow_t;
+
+void *arena_alloc(arena_t *arena, int size)
+{
+    size = ARENA_ALIGN(size);
+    arena->used += size;
+
+    if (arena->used > arena->high_water)
+        arena->high_water = arena->used;
+
+    if (arena->used <= arena->capacity)
+    {
+        return arena->memory + arena->used - size;
+    }
+
+    // Out of space for this frame, fall back to the heap until the next reset grows memory
+    arena_overflow_t *block = (arena_overflow_t *)malloc(sizeof(arena_overflow_t) + size);
+    block->next = arena->overflow;
+    arena->overflow = block;
+    return block + 1;
+}
+
+void *arena_array_hold(arena_t *arena, void *array, int count, int item_size)
+{
+    if (array != NULL && ARRAY_OCCUPIED(array) + count <= ARRAY_CAPACITY(array))
+    {
+        ARRAY_OCCUPIED(array) += count;
+        return array;
+    }
+
+    int occupied = array_length(array) + count;
+    int capacity = array != NULL ? ARRAY_CAPACITY(array) * 2 : count;
+    if (capacity < occupied)
+        capacity = occupied;
+
+    // Grow in place when the array is the most recent allocation of the arena
+    if (array != NULL)
+    {
+        char *array_end = (char *)array + ARENA_ALIGN(ARRAY_CAPACITY(array) * item_size + (int)sizeof(int) * 2) - (int)sizeof(int) * 2;
+        int extra = ARENA_ALIGN(capacity * item_size + (int)sizeof(int) * 2) -
+                    ARENA_ALIGN(ARRAY_CAPACITY(array) * item_size + (int)sizeof(int) * 2);
+
+        if (array_end == arena->memory + arena->used && arena->used + extra <= arena->capacity)
+        {
+            arena->used += extra;
+            if (arena->used > arena->high_water)
+                arena->high_water = arena->used;
+
+            ARRAY_CAPACITY(array) = capacity;
+            ARRAY_OCCUPIED(array) = occupied;
+            return array;
+        }
+    }
+
+    // Otherwise move it to a fresh block, the old one is reclaimed by the next reset
+    int *base = (int *)arena_alloc(arena, (int)sizeof(int) * 2 + item_size * capacity);
+    if (array != NULL)
+    {
+        memcpy(base + 2, array, ARRAY_OCCUPIED(array) * item_size);
+    }
+    base[0] = capacity;
+    base[1] = occupied;
+    return base + 2;
+}
+
+void arena_reset(arena_t *arena)
+{
+    while (arena->overflow != NULL)
+    {
+        arena_overflow_t *block = (arena_overflow_t *)arena->overflow;
+        arena->overflow = block->next;
+        free(block);
+    }
+
+    // Grow to the high-water mark so the next frame fits in a single block
+    if (arena->high_water > arena->capacity)
+    {
+        free(arena->memory);
+        arena->memory = (char *)malloc(arena->high_water);
+        arena->capacity = arena->high_water;
+    }
+
+    arena->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->memory);
+    arena->memory = NULL;
+    arena->capacity = 0;
+    arena->high_water = 0;
+}
@@ -8,8 +8,43 @@
         (array)[array_length(array) - 1] = (value);         \
     } while (0);
 
+// Same as array_push but for arrays living in an arena, never array_free these
+#define arena_array_push(arena, array, value)                                \
+    do                                                                       \
+    {                                                                        \
+        (array) = arena_array_hold((arena), (array), 1, sizeof(*(array)));   \
+        (array)[array_length(array) - 1] = (value);                          \
+    } while (0);
+
 void *array_hold(void *array, int count, int item_size);
 int array_length(void *array);
 void array_free(void *array);
 
+// Drops the items past the first count ones, the memory is kept for later pushes
+void array_truncate(void *array, int count);
+
+// Bytes every array keeps in front of its items
+#define ARRAY_HEADER_SIZE (sizeof(int) * 2)
+
+// Turns count items laid out after ARRAY_HEADER_SIZE bytes of room, in memory
+// that doesn't come from array_hold, into an array. Never push to or free it.
+void *array_init_header(void *header, int count);
+
+// Bump allocator for data that lives for a single frame. arena_reset releases
+// everything at once and keeps the largest size seen, so once warmed up a
+// frame does no heap allocations at all.
+typedef struct
+{
+    char *memory;
+    int capacity;   // Bytes in memory
+    int used;       // Bytes handed out since the last reset
+    int high_water; // Most bytes handed out in any frame
+    void *overflow; // Heap blocks handed out after memory ran out, freed on reset
+} arena_t;
+
+void *arena_alloc(arena_t *arena, int size);
+void *arena_array_hold(arena_t *arena, void *array, int count, int item_size);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
 #endif
\ No newline at end of file
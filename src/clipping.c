@@ -0,0 +1,222 @@
+#include "clipping.h"
+#include <math.h>
+#include <stdbool.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Frustum clipping in homogeneous clip space
+///////////////////////////////////////////////////////////////////////////////
+// After the projection matrix a vertex is inside the view frustum when
+// -w <= x <= w, -w <= y <= w and 0 <= z <= w, the near and far planes being
+// the znear and zfar the projection was made with. Clipping here, before the
+// perspective divide, keeps vertices behind the camera (w <= 0) from ever
+// being divided and keeps screen coordinates bounded for the rasterizer.
+// Attributes are linear in clip space, so they are interpolated as they are.
+//
+// Faces crossing the side planes are not cut, as long as they stay inside a
+// much wider guard band the rasterizer clips them per pixel for free. Only
+// near, far and guard band violations, which are rare, split polygons.
+///////////////////////////////////////////////////////////////////////////////
+
+// Guard band half extents in clip space units of w, set by init_guard_band
+static float guard_band_x = 1.0f;
+static float guard_band_y = 1.0f;
+
+void init_guard_band(int viewport_width, int viewport_height)
+{
+    guard_band_x = GUARD_BAND_SIZE / (viewport_width / 2.0f);
+    guard_band_y = GUARD_BAND_SIZE / (viewport_height / 2.0f);
+}
+
+// Signed distance of a vertex to a plane, negative outside
+static float plane_distance(vec4_t v, int plane)
+{
+    switch (plane)
+    {
+    case LEFT_FRUSTUM_PLANE:
+        return v.w + v.x;
+    case RIGHT_FRUSTUM_PLANE:
+        return v.w - v.x;
+    case TOP_FRUSTUM_PLANE:
+        return v.w - v.y;
+    case BOTTOM_FRUSTUM_PLANE:
+        return v.w + v.y;
+    case NEAR_FRUSTUM_PLANE:
+        return v.z;
+    case FAR_FRUSTUM_PLANE:
+        return v.w - v.z;
+    case LEFT_GUARD_BAND_PLANE:
+        return v.w * guard_band_x + v.x;
+    case RIGHT_GUARD_BAND_PLANE:
+        return v.w * guard_band_x - v.x;
+    case TOP_GUARD_BAND_PLANE:
+        return v.w * guard_band_y - v.y;
+    default:
+        return v.w * guard_band_y + v.y;
+    }
+}
+
+int clip_outcode(vec4_t v)
+{
+    int outcode = 0;
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= BOTTOM_GUARD_BAND_PLANE; plane <<= 1)
+    {
+        if (plane_distance(v, plane) < 0)
+            outcode |= plane;
+    }
+
+    return outcode;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests a sphere given in camera space against the frustum planes
+///////////////////////////////////////////////////////////////////////////////
+// plane_distance is linear in the vertex and the vertex is the projection
+// applied to the camera space point, so applying plane_distance to the
+// columns of the projection gives the plane equation in camera space.
+///////////////////////////////////////////////////////////////////////////////
+frustum_test_t frustum_test_sphere(mat4_t projection_matrix, vec3_t center, float radius)
+{
+    frustum_test_t result = FRUSTUM_INSIDE;
+
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= FAR_FRUSTUM_PLANE; plane <<= 1)
+    {
+        float equation[4];
+        for (int j = 0; j < 4; j++)
+        {
+            vec4_t column = {projection_matrix.m[0][j], projection_matrix.m[1][j], projection_matrix.m[2][j], projection_matrix.m[3][j]};
+            equation[j] = plane_distance(column, plane);
+        }
+
+        float length = sqrt(equation[0] * equation[0] + equation[1] * equation[1] + equation[2] * equation[2]);
+        float distance = (equation[0] * center.x + equation[1] * center.y + equation[2] * center.z + equation[3]) / length;
+
+        if (distance < -radius)
+            return FRUSTUM_OUTSIDE;
+        if (distance < radius)
+            result = FRUSTUM_INTERSECTING;
+    }
+
+    return result;
+}
+
+// Tests a model space box against the frustum by the outcodes of its corners
+frustum_test_t frustum_test_box(mat4_t model_view_projection_matrix, vec3_t min, vec3_t max)
+{
+    int outcode_and = FRUSTUM_PLANES;
+    int outcode_or = 0;
+
+    for (int i = 0; i < 8; i++)
+    {
+        vec4_t corner = {
+            .x = (i & 1) ? max.x : min.x,
+            .y = (i & 2) ? max.y : min.y,
+            .z = (i & 4) ? max.z : min.z,
+            .w = 1,
+        };
+        int outcode = clip_outcode(mat4_mul_vec4(model_view_projection_matrix, corner)) & FRUSTUM_PLANES;
+        outcode_and &= outcode;
+        outcode_or |= outcode;
+    }
+
+    if (outcode_and)
+        return FRUSTUM_OUTSIDE;
+
+    return outcode_or ? FRUSTUM_INTERSECTING : FRUSTUM_INSIDE;
+}
+
+void polygon_from_triangle(polygon_t *polygon, vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2)
+{
+    polygon->vertices[0] = v0;
+    polygon->vertices[1] = v1;
+    polygon->vertices[2] = v2;
+    polygon->texcoords[0] = t0;
+    polygon->texcoords[1] = t1;
+    polygon->texcoords[2] = t2;
+    polygon->num_vertices = 3;
+}
+
+static float float_lerp(float a, float b, float t)
+{
+    return a + t * (b - a);
+}
+
+// Sutherland-Hodgman against one plane, from polygon into result
+static void clip_polygon_against_plane(const polygon_t *polygon, polygon_t *result, int plane)
+{
+    result->num_vertices = 0;
+
+    int previous = polygon->num_vertices - 1;
+    float previous_distance = plane_distance(polygon->vertices[previous], plane);
+
+    for (int current = 0; current < polygon->num_vertices; current++)
+    {
+        float current_distance = plane_distance(polygon->vertices[current], plane);
+        bool is_current_inside = current_distance >= 0;
+        bool is_previous_inside = previous_distance >= 0;
+
+        if (is_current_inside != is_previous_inside)
+        {
+            // Always interpolate from the inside vertex, so the two triangles sharing
+            // this edge get the exact same intersection point and no cracks open up
+            int in = is_current_inside ? current : previous;
+            int out = is_current_inside ? previous : current;
+            float in_distance = is_current_inside ? current_distance : previous_distance;
+            float out_distance = is_current_inside ? previous_distance : current_distance;
+            float t = in_distance / (in_distance - out_distance);
+
+            vec4_t a = polygon->vertices[in], b = polygon->vertices[out];
+            tex2_t ta = polygon->texcoords[in], tb = polygon->texcoords[out];
+
+            vec4_t *v = &result->vertices[result->num_vertices];
+            v->x = float_lerp(a.x, b.x, t);
+            v->y = float_lerp(a.y, b.y, t);
+            v->z = float_lerp(a.z, b.z, t);
+            v->w = float_lerp(a.w, b.w, t);
+            result->texcoords[result->num_vertices].u = float_lerp(ta.u, tb.u, t);
+            result->texcoords[result->num_vertices].v = float_lerp(ta.v, tb.v, t);
+            result->num_vertices++;
+        }
+
+        if (is_current_inside)
+        {
+            result->vertices[result->num_vertices] = polygon->vertices[current];
+            result->texcoords[result->num_vertices] = polygon->texcoords[current];
+            result->num_vertices++;
+        }
+
+        previous = current;
+        previous_distance = current_distance;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Clips the polygon in place against the planes set in the planes mask
+///////////////////////////////////////////////////////////////////////////////
+// Pass the union of the vertex outcodes masked with GEOMETRIC_CLIP_PLANES, planes
+// no vertex is outside of can't change the polygon. The result has fewer than 3
+// vertices when nothing is left.
+///////////////////////////////////////////////////////////////////////////////
+void clip_polygon(polygon_t *polygon, int planes)
+{
+    polygon_t scratch;
+    polygon_t *source = polygon;
+    polygon_t *target = &scratch;
+
+    for (int plane = LEFT_FRUSTUM_PLANE; plane <= BOTTOM_GUARD_BAND_PLANE; plane <<= 1)
+    {
+        if (!(planes & plane))
+            continue;
+
+        clip_polygon_against_plane(source, target, plane);
+
+        polygon_t *tmp = source;
+        source = target;
+        target = tmp;
+
+        if (source->num_vertices < 3)
+            break;
+    }
+
+    if (source != polygon)
+        *polygon = *source;
+}
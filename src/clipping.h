@@ -0,0 +1,62 @@
+#ifndef CLIPPING_H
+#define CLIPPING_H
+
+#include "vector.h"
+#include "matrix.h"
+#include "texture.h"
+
+// A triangle gains at most one vertex for every plane it is clipped against
+#define MAX_NUM_POLY_VERTICES 9
+
+// Distance in pixels from the center of the viewport that projected vertices may reach
+// without geometric clipping, the rasterizer only clips their bounding box to the viewport.
+// Keeps screen coordinates well inside what its 32-bit SIMD edge functions can handle.
+#define GUARD_BAND_SIZE 8192
+
+// One bit per plane, set in an outcode when a vertex lies outside of it
+enum
+{
+    LEFT_FRUSTUM_PLANE = 1 << 0,
+    RIGHT_FRUSTUM_PLANE = 1 << 1,
+    TOP_FRUSTUM_PLANE = 1 << 2,
+    BOTTOM_FRUSTUM_PLANE = 1 << 3,
+    NEAR_FRUSTUM_PLANE = 1 << 4,
+    FAR_FRUSTUM_PLANE = 1 << 5,
+    LEFT_GUARD_BAND_PLANE = 1 << 6,
+    RIGHT_GUARD_BAND_PLANE = 1 << 7,
+    TOP_GUARD_BAND_PLANE = 1 << 8,
+    BOTTOM_GUARD_BAND_PLANE = 1 << 9,
+
+    FRUSTUM_PLANES = (1 << 6) - 1,
+
+    // Planes polygons are actually cut against, the side planes of the
+    // frustum are left to the rasterizer and only used for rejection
+    GEOMETRIC_CLIP_PLANES = NEAR_FRUSTUM_PLANE | FAR_FRUSTUM_PLANE |
+                            LEFT_GUARD_BAND_PLANE | RIGHT_GUARD_BAND_PLANE |
+                            TOP_GUARD_BAND_PLANE | BOTTOM_GUARD_BAND_PLANE
+};
+
+// Where a bounding volume lies relative to the view frustum
+typedef enum
+{
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTING,
+    FRUSTUM_INSIDE
+} frustum_test_t;
+
+// Convex polygon in clip space, a fan around vertices[0]
+typedef struct
+{
+    vec4_t vertices[MAX_NUM_POLY_VERTICES];
+    tex2_t texcoords[MAX_NUM_POLY_VERTICES];
+    int num_vertices;
+} polygon_t;
+
+void init_guard_band(int viewport_width, int viewport_height);
+int clip_outcode(vec4_t v);
+frustum_test_t frustum_test_sphere(mat4_t projection_matrix, vec3_t center, float radius);
+frustum_test_t frustum_test_box(mat4_t model_view_projection_matrix, vec3_t min, vec3_t max);
+void polygon_from_triangle(polygon_t *polygon, vec4_t v0, vec4_t v1, vec4_t v2, tex2_t t0, tex2_t t1, tex2_t t2);
+void clip_polygon(polygon_t *polygon, int planes);
+
+#endif
@@ -1,16 +1,26 @@
 #include "display.h"
 #include <math.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DISPLAY_SSE2
+#endif
 
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 
 uint32_t *color_buffer = NULL;
 float *z_buffer = NULL;
+bool is_depth_test_enabled = true;
 SDL_Texture *color_buffer_texture = NULL;
 
 int window_width = 800;
 int window_height = 600;
 
+// Each thread starts with an empty clip rect, the main thread gets the window in initialize_window
+THREAD_LOCAL clip_rect_t clip_rect = {0, 0, 0, 0};
+
 bool initialize_window(void)
 {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
@@ -51,26 +61,80 @@ bool initialize_window(void)
         return false;
     }
 
+    set_clip_rect(0, 0, window_width, window_height);
+
     return true;
 }
 
+void set_clip_rect(int min_x, int min_y, int max_x, int max_y)
+{
+    clip_rect.min_x = min_x;
+    clip_rect.min_y = min_y;
+    clip_rect.max_x = max_x;
+    clip_rect.max_y = max_y;
+}
+
+// Stores count copies of the 32-bit value at dst, 16 bytes at a time once dst is aligned
+static void fill_words(void *dst, uint32_t value, size_t count)
+{
+    unsigned char *p = dst;
+    size_t i = 0;
+
+#ifdef DISPLAY_SSE2
+    for (; i < count && ((uintptr_t)(p + i * 4) & 15) != 0; i++)
+        memcpy(p + i * 4, &value, 4);
+
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm_store_si128((__m128i *)(p + i * 4), v);
+        _mm_store_si128((__m128i *)(p + i * 4 + 16), v);
+        _mm_store_si128((__m128i *)(p + i * 4 + 32), v);
+        _mm_store_si128((__m128i *)(p + i * 4 + 48), v);
+    }
+    for (; i + 4 <= count; i += 4)
+        _mm_store_si128((__m128i *)(p + i * 4), v);
+#endif
+
+    for (; i < count; i++)
+        memcpy(p + i * 4, &value, 4);
+}
+
+void draw_span(int x0, int x1, int y, uint32_t color)
+{
+    // Clip the whole span once instead of every pixel
+    if (y < clip_rect.min_y || y >= clip_rect.max_y)
+        return;
+    if (x0 < clip_rect.min_x)
+        x0 = clip_rect.min_x;
+    if (x1 > clip_rect.max_x - 1)
+        x1 = clip_rect.max_x - 1;
+    if (x0 > x1)
+        return;
+
+    fill_words(&color_buffer[(window_width * y) + x0], color, (size_t)(x1 - x0 + 1));
+}
+
 void draw_grid(void)
 {
     for (int y = 0; y < window_height; y++)
     {
-        for (int x = 0; x < window_width; x++)
+        if (y % 10 == 0)
         {
-            if (y % 10 == 0 || x % 10 == 0)
-            {
-                color_buffer[(window_width * y) + x] = 0xFF1C1C1C;
-            }
+            draw_span(0, window_width - 1, y, 0xFF1C1C1C);
+            continue;
+        }
+
+        for (int x = 0; x < window_width; x += 10)
+        {
+            draw_pixel(x, y, 0xFF1C1C1C);
         }
     }
 }
 
 void draw_pixel(int x, int y, uint32_t color)
 {
-    if (x >= 0 && x < window_width && y >= 0 && y < window_height)
+    if (x >= clip_rect.min_x && x < clip_rect.max_x && y >= clip_rect.min_y && y < clip_rect.max_y)
     {
         color_buffer[(window_width * y) + x] = color;
     }
@@ -78,16 +142,54 @@ void draw_pixel(int x, int y, uint32_t color)
 
 void draw_rect(int x, int y, int width, int height, uint32_t color)
 {
-    for (int j = 0; j < width; j++)
+    if (width <= 0)
+        return;
+
+    for (int k = 0; k < height; k++)
     {
-        for (int k = 0; k < height; k++)
-        {
-            int current_x = j + x;
-            int current_y = k + y;
+        draw_span(x, x + width - 1, y + k, color);
+    }
+}
 
-            draw_pixel(current_x, current_y, color);
-        }
+// Rounded coordinate of step i along one axis of a line, the same for clipping and drawing
+static int line_coordinate(float start, float inc, int i)
+{
+    return (int)roundf(start + i * inc);
+}
+
+// First of the steps lo..hi whose coordinate has reached bound going the way of inc, hi + 1 if none has.
+// The coordinate never moves back, so a binary search finds it.
+static int first_step_reaching(float start, float inc, int bound, int lo, int hi)
+{
+    hi++;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        int c = line_coordinate(start, inc, mid);
+        if (inc > 0 ? c >= bound : c <= bound)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// Narrows the steps first..last to those whose coordinate lies in min..max - 1
+static void clip_line_axis(float start, float inc, int min, int max, int *first, int *last)
+{
+    if (inc == 0)
+    {
+        int c = line_coordinate(start, inc, 0);
+        if (c < min || c >= max)
+            *last = *first - 1;
+        return;
     }
+
+    int enter = inc > 0 ? min : max - 1;
+    int leave = inc > 0 ? max : min - 1;
+    int new_first = first_step_reaching(start, inc, enter, *first, *last);
+    *last = first_step_reaching(start, inc, leave, new_first, *last) - 1;
+    *first = new_first;
 }
 
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
@@ -96,18 +198,21 @@ void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
     int dy = y1 - y0;
 
     int side_length = abs(dx) >= abs(dy) ? abs(dx) : abs(dy);
+    if (side_length == 0)
+        return;
 
     float x_inc = dx / (float)side_length;
     float y_inc = dy / (float)side_length;
 
-    float current_x = x0;
-    float current_y = y0;
+    // Only step over the part inside the clip rect, a tile gets just its piece of a long edge
+    int first = 0;
+    int last = side_length;
+    clip_line_axis(x0, x_inc, clip_rect.min_x, clip_rect.max_x, &first, &last);
+    clip_line_axis(y0, y_inc, clip_rect.min_y, clip_rect.max_y, &first, &last);
 
-    for (int i = 0; i <= side_length; i++)
+    for (int i = first; i <= last; i++)
     {
-        draw_pixel(roundf(current_x), roundf(current_y), color);
-        current_x += x_inc;
-        current_y += y_inc;
+        color_buffer[(window_width * line_coordinate(y0, y_inc, i)) + line_coordinate(x0, x_inc, i)] = color;
     }
 }
 
@@ -131,24 +236,16 @@ void render_color_buffer(void)
 
 void clear_color_buffer(uint32_t color)
 {
-    for (int y = 0; y < window_height; y++)
-    {
-        for (int x = 0; x < window_width; x++)
-        {
-            color_buffer[(window_width * y) + x] = color;
-        }
-    }
+    fill_words(color_buffer, color, (size_t)window_width * window_height);
 }
 
 void clear_z_buffer(void)
 {
-    for (int y = 0; y < window_height; y++)
-    {
-        for (int x = 0; x < window_width; x++)
-        {
-            z_buffer[(window_width * y) + x] = 1.0;
-        }
-    }
+    float depth = 1.0f;
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits));
+
+    fill_words(z_buffer, depth_bits, (size_t)window_width * window_height);
 }
 
 void destroy_window(void)
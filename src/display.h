@@ -8,17 +8,36 @@
 #define FPS 30
 #define FRAME_TARGET_TIME (1000 / FPS)
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Region of the buffers the current thread may draw into, max_x and max_y are exclusive
+typedef struct
+{
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+} clip_rect_t;
+
 extern SDL_Window *window;
 extern SDL_Renderer *renderer;
 extern uint32_t *color_buffer;
 extern float *z_buffer;
+extern bool is_depth_test_enabled;
 extern SDL_Texture *color_buffer_texture;
 extern int window_width;
 extern int window_height;
+extern THREAD_LOCAL clip_rect_t clip_rect;
 
 bool initialize_window(void);
+void set_clip_rect(int min_x, int min_y, int max_x, int max_y);
 void draw_grid(void);
 void draw_pixel(int x, int y, uint32_t color);
+void draw_span(int x0, int x1, int y, uint32_t color);
 void draw_rect(int x, int y, int width, int height, uint32_t color);
 void draw_line(int x0, int y0, int x1, int y1, uint32_t color);
 void draw_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
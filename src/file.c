@@ -0,0 +1,117 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_POPULATE
+#include "file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define FILE_MAP_WITH_READ
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Whole file in memory, mapped where the platform allows it
+///////////////////////////////////////////////////////////////////////////////
+// Mapping skips the copy through stdio buffers, readers walk the pages
+// straight out of the page cache. Platforms without mmap read the file
+// into one heap block instead.
+///////////////////////////////////////////////////////////////////////////////
+bool map_file(const char *filename, mapped_file_t *file)
+{
+    file->data = NULL;
+    file->size = 0;
+
+#ifdef FILE_MAP_WITH_READ
+    FILE *stream = fopen(filename, "rb");
+    if (stream == NULL)
+        return false;
+
+    fseek(stream, 0, SEEK_END);
+    long size = ftell(stream);
+    fseek(stream, 0, SEEK_SET);
+
+    char *data = malloc(size > 0 ? size : 1);
+    file->size = fread(data, 1, size > 0 ? size : 0, stream);
+    file->data = data;
+    fclose(stream);
+    return true;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Fault every page in up front rather than one at a time while parsing
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+
+    // mmap refuses empty mappings, an empty file simply has no data
+    if (status.st_size > 0)
+    {
+        void *data = mmap(NULL, status.st_size, PROT_READ, flags, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        file->data = data;
+        file->size = status.st_size;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return true;
+#endif
+}
+
+void unmap_file(mapped_file_t *file)
+{
+#ifdef FILE_MAP_WITH_READ
+    free((void *)file->data);
+#else
+    if (file->size > 0)
+        munmap((void *)file->data, file->size);
+#endif
+    file->data = NULL;
+    file->size = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// 64-bit hash of a block of memory, to tell whether a file changed
+///////////////////////////////////////////////////////////////////////////////
+// Mixes in 8 bytes per multiplication, fast enough to hash a source file on
+// every start. Not meant to resist deliberate collisions.
+///////////////////////////////////////////////////////////////////////////////
+uint64_t hash_bytes(const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = 0xcbf29ce484222325ull ^ size;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+
+    uint64_t tail = 0;
+    if (i < size)
+        memcpy(&tail, bytes + i, size - i);
+    hash = (hash ^ tail) * 0x9e3779b97f4a7c15ull;
+    return hash ^ (hash >> 32);
+}
@@ -0,0 +1,19 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read only contents of a whole file, see map_file
+typedef struct
+{
+    const char *data;
+    size_t size;
+} mapped_file_t;
+
+bool map_file(const char *filename, mapped_file_t *file);
+void unmap_file(mapped_file_t *file);
+uint64_t hash_bytes(const void *data, size_t size);
+
+#endif
@@ -12,8 +12,13 @@
 #include "triangle.h"
 #include "upng.h"
 #include "camera.h"
+#include "tile.h"
+#include "clipping.h"
 
-triangle_t *triangles_to_render = NULL;
+arena_t frame_arena = {NULL, 0, 0, 0, NULL}; // Memory released at the start of every frame
+
+triangle_t *triangles_to_render = NULL;        // Triangle payload in submission order, lives in frame_arena
+triangle_sort_key_t *triangle_draw_order = NULL; // Indices into triangles_to_render back to front, NULL when unsorted
 
 mat4_t projection_matrix;
 mat4_t view_matrix;
@@ -34,6 +39,7 @@ typedef enum
 rendering_mode_t render_mode = solid;
 
 bool is_culling_enabled = true;
+bool is_tiled_rendering_enabled = true;
 
 void setup(void)
 {
@@ -56,6 +62,14 @@ void setup(void)
     float zfar = 100.0;
     projection_matrix = mat4_make_perspective(fov, aspect, znear, zfar);
 
+    // Let the rasterizer handle vertices up to GUARD_BAND_SIZE pixels off the center of the screen
+    init_guard_band(window_width, window_height);
+
+    // Pick the widest pixel and vertex transform kernels the CPU supports, then start the tiled rasterizer workers
+    init_raster_kernels();
+    init_transform_kernels(SDL_HasSSE2(), SDL_HasAVX2());
+    tiles_init();
+
     // Manually load hardcoded texture data
     /*mesh_texture = (uint32_t *)REDBRICK_TEXTURE;
     texture_width = 64;
@@ -95,6 +109,14 @@ void process_input(void)
             is_culling_enabled = true;
         if (event.key.keysym.sym == SDLK_v)
             is_culling_enabled = false;
+        if (event.key.keysym.sym == SDLK_m)
+            is_tiled_rendering_enabled = true;
+        if (event.key.keysym.sym == SDLK_n)
+            is_tiled_rendering_enabled = false;
+        if (event.key.keysym.sym == SDLK_z)
+            is_depth_test_enabled = true;
+        if (event.key.keysym.sym == SDLK_x)
+            is_depth_test_enabled = false;
         // Camera up
         if (event.key.keysym.sym == SDLK_UP)
             camera.position.y += 3.0 * delta_time;
@@ -146,6 +168,9 @@ void update(void)
 
     previous_frame_time = SDL_GetTicks();
 
+    // Release last frame's triangles, the arena keeps its memory for reuse
+    arena_reset(&frame_arena);
+
     // Initialize the array of triangles to render
     triangles_to_render = NULL;
 
@@ -169,193 +194,231 @@ void update(void)
 
     view_matrix = mat4_look_at(camera.position, target, up);
 
-    // Create scaale matrix that will be used to multiple mesh verticies
-    mat4_t scale_matrix = mat4_make_scale(mesh.scale.x, mesh.scale.y, mesh.scale.z);
-    mat4_t translation_matrix = mat4_make_translation(mesh.translation.x, mesh.translation.y, mesh.translation.z);
-    mat4_t rotation_x_matrix = mat4_make_rotation_x(mesh.rotation.x);
-    mat4_t rotation_y_matrix = mat4_make_rotation_y(mesh.rotation.y);
-    mat4_t rotation_z_matrix = mat4_make_rotation_z(mesh.rotation.z);
-
-    int num_mesh_faces = array_length(mesh.faces);
-    // Loop all triangle faces of our mesh
-    for (int i = 0; i < num_mesh_faces; i++)
-    {
-        face_t mesh_face = mesh.faces[i];
-
-        vec3_t face_vertices[3];
-        face_vertices[0] = mesh.vertices[mesh_face.a];
-        face_vertices[1] = mesh.vertices[mesh_face.b];
-        face_vertices[2] = mesh.vertices[mesh_face.c];
-
-        vec4_t transformed_verticies[3];
-
-        // Loop all three vertices of this current face and apply transformations
-        for (int j = 0; j < 3; j++)
-        {
-            vec4_t transformed_vertex = vec4_from_vec3(face_vertices[j]);
-
-            // Create a world matrix combining scale, translate, and rotation
-            mat4_t world_matrix = mat4_identity();
-            world_matrix = mat4_mul_mat4(scale_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_x_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_y_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(rotation_z_matrix, world_matrix);
-            world_matrix = mat4_mul_mat4(translation_matrix, world_matrix);
+    // Rebuild the cached world and model-view matrices only if the mesh or camera moved
+    mesh_update_transform(&mesh, view_matrix);
 
-            // Multiply transformed_vertex by world_matrix
-            transformed_vertex = mat4_mul_vec4(world_matrix, transformed_vertex);
+    // Skip the whole mesh when its bounds are outside the view frustum,
+    // and the per-face clipping when they are completely inside of it
+    frustum_test_t mesh_visibility = mesh_test_frustum(&mesh, projection_matrix);
 
-            // Multiply view_matrix by the vector to transform the scene to camera space
-            transformed_vertex = mat4_mul_vec4(view_matrix, transformed_vertex);
-
-            // Save tranformed verticies
-            transformed_verticies[j] = transformed_vertex;
-        }
-
-        // Check backface culling
-        vec3_t vector_a = vec3_from_vec4(transformed_verticies[0]); // A
-        vec3_t vector_b = vec3_from_vec4(transformed_verticies[1]); // B
-        vec3_t vector_c = vec3_from_vec4(transformed_verticies[2]); // C
-
-        vec3_t vector_ab = vec3_sub(vector_b, vector_a);
-        vec3_t vector_ac = vec3_sub(vector_c, vector_a);
-        vec3_normalize(&vector_ab);
-        vec3_normalize(&vector_ac);
+    if (mesh_visibility != FRUSTUM_OUTSIDE)
+    {
+        // Cull clusters and backfaces in model space, so vertices only used by culled faces are never transformed
+        mesh_select_visible_faces(&mesh, camera.position, projection_matrix, mesh_visibility, is_culling_enabled);
 
-        vec3_t normal = vec3_cross(vector_ab, vector_ac);
-        vec3_normalize(&normal);
+        // Transform the unique vertices of the visible faces to camera and clip space
+        mesh_transform_vertices(&mesh, projection_matrix);
+    }
 
-        vec3_t origin = {0, 0, 0};
-        vec3_t camera_ray = vec3_sub(origin, vector_a);
+    // Clipped polygon of the current face, reused for every face
+    polygon_t polygon;
 
-        // calc alginment with camera
-        float dot_alignment_to_camera = vec3_dot(normal, camera_ray);
+    int num_visible_clusters = mesh_visibility != FRUSTUM_OUTSIDE ? mesh.num_visible_clusters : 0;
+    // Loop all triangle faces of our mesh that face the camera, cluster by cluster
+    for (int k = 0; k < num_visible_clusters; k++)
+    {
+        visible_cluster_t cluster = mesh.visible_clusters[k];
 
-        if (dot_alignment_to_camera < 0 && is_culling_enabled)
+        for (int f = cluster.first_visible_face; f < cluster.first_visible_face + cluster.num_visible_faces; f++)
         {
-            continue;
+            int i = mesh.visible_faces[f];
+            face_t mesh_face = mesh.faces[i];
+
+            // Fetch the already transformed vertices of this face by index
+            vec4_t transformed_verticies[3];
+            transformed_verticies[0] = mesh.view_vertices[mesh_face.a];
+            transformed_verticies[1] = mesh.view_vertices[mesh_face.b];
+            transformed_verticies[2] = mesh.view_vertices[mesh_face.c];
+
+            vec4_t clip_points[3];
+            clip_points[0] = mesh.clip_vertices[mesh_face.a];
+            clip_points[1] = mesh.clip_vertices[mesh_face.b];
+            clip_points[2] = mesh.clip_vertices[mesh_face.c];
+
+            polygon_from_triangle(
+                &polygon,
+                clip_points[0], clip_points[1], clip_points[2],
+                mesh.texcoords[mesh_face.a], mesh.texcoords[mesh_face.b], mesh.texcoords[mesh_face.c]);
+
+            if (cluster.visibility == FRUSTUM_INTERSECTING)
+            {
+                // Skip the face if all of it lies outside the same frustum plane
+                int outcode_a = clip_outcode(clip_points[0]);
+                int outcode_b = clip_outcode(clip_points[1]);
+                int outcode_c = clip_outcode(clip_points[2]);
+                if (outcode_a & outcode_b & outcode_c)
+                {
+                    continue;
+                }
+
+                // Only faces crossing the near or far plane or leaving the guard band need clipping,
+                // and only against the planes they cross. Partially off-screen faces are left to the rasterizer
+                int clip_planes = (outcode_a | outcode_b | outcode_c) & GEOMETRIC_CLIP_PLANES;
+                if (clip_planes)
+                {
+                    clip_polygon(&polygon, clip_planes);
+                }
+            }
+
+            // Calculate avg depth for each face of the vertices z-value
+            float avg_depth = (transformed_verticies[0].z + transformed_verticies[1].z + transformed_verticies[2].z) / 3.0;
+
+            // Calculate flat shading on triangle
+            vec3_t normal = mesh_face_view_normal(&mesh, i);
+            float light_intensity_dot = -vec3_dot(normal, global_light.direction);
+            uint32_t triangle_flat_shaded_color = light_apply_intensity(mesh_face.color, light_intensity_dot);
+
+            // Perform projection on the vertices of the clipped polygon
+            for (int j = 0; j < polygon.num_vertices; j++)
+            {
+                // Project the current vertex
+                polygon.vertices[j] = vec4_perspective_divide(polygon.vertices[j]);
+
+                // Scale
+                polygon.vertices[j].x *= (window_width / 2.0);
+                polygon.vertices[j].y *= (window_height / 2.0);
+
+                // Invert the y value to account for flipped y coordinates
+                polygon.vertices[j].y *= -1;
+
+                // Translate the projected points to the middle of the screen
+                polygon.vertices[j].x += (window_width / 2.0);
+                polygon.vertices[j].y += (window_height / 2.0);
+            }
+
+            // Break the polygon up into a fan of triangles around its first vertex
+            for (int j = 1; j + 1 < polygon.num_vertices; j++)
+            {
+                triangle_t projected_triangle = {
+                    .points = {polygon.vertices[0], polygon.vertices[j], polygon.vertices[j + 1]},
+                    .texcoords = {polygon.texcoords[0], polygon.texcoords[j], polygon.texcoords[j + 1]},
+                    .color = triangle_flat_shaded_color,
+                    .avg_depth = avg_depth,
+                };
+
+                // Save the projected triangle in the array of triangles to render
+                arena_array_push(&frame_arena, triangles_to_render, projected_triangle);
+            }
         }
+    }
 
-        vec4_t projected_points[3];
+    // Painter's sorting is only needed when something is drawn without depth testing,
+    // otherwise triangles are drawn in submission order and the z-buffer resolves visibility
+    bool is_depth_resolved = is_depth_test_enabled && (render_mode == solid || render_mode == textures);
 
-        // Perform projection on verticies
-        for (int j = 0; j < 3; j++)
-        {
-            // Project the current vertex
-            projected_points[j] = mat4_mul_vec4_project(projection_matrix, transformed_verticies[j]);
+    // Sort the triangle indices by avg_depth, the triangles themselves stay in place
+    triangle_draw_order = is_depth_resolved ? NULL : sort_triangles(triangles_to_render, &frame_arena);
+}
 
-            // Scale
-            projected_points[j].x *= (window_width / 2.0);
-            projected_points[j].y *= (window_height / 2.0);
+////////////////////////////////////////////////////////////////////////////////
+// Draws the triangle at position draw_index of the draw order with the current
+// render mode, limited to the clip rect of the calling thread
+////////////////////////////////////////////////////////////////////////////////
+void draw_render_triangle(int draw_index)
+{
+    int index = triangle_draw_order != NULL ? (int)triangle_draw_order[draw_index].index : draw_index;
+    triangle_t *triangle = &triangles_to_render[index];
 
-            // Invert the y value to account for flipped y coordinates
-            projected_points[j].y *= -1;
+    if (render_mode == solid || render_mode == all)
+    {
+        // Draw filled triangle
+        draw_filled_triangle(
+            triangle->points[0].x,
+            triangle->points[0].y,
+            triangle->points[0].w,
+            triangle->points[1].x,
+            triangle->points[1].y,
+            triangle->points[1].w,
+            triangle->points[2].x,
+            triangle->points[2].y,
+            triangle->points[2].w,
+            triangle->color);
+    }
 
-            // Translate the projected points to the middle of the screen
-            projected_points[j].x += (window_width / 2.0);
-            projected_points[j].y += (window_height / 2.0);
-        }
+    if (render_mode == textures || render_mode == all)
+    {
+        // draw_textured_triangle()
+        draw_textured_triangle(
+            // 1
+            triangle->points[0].x,
+            triangle->points[0].y,
+            triangle->points[0].w,
+            triangle->texcoords[0].u,
+            triangle->texcoords[0].v,
+
+            // 2
+            triangle->points[1].x,
+            triangle->points[1].y,
+            triangle->points[1].w,
+            triangle->texcoords[1].u,
+            triangle->texcoords[1].v,
+
+            // 3
+            triangle->points[2].x,
+            triangle->points[2].y,
+            triangle->points[2].w,
+            triangle->texcoords[2].u,
+            triangle->texcoords[2].v,
+
+            // Texture
+            mesh_texture);
+    }
 
-        // Calculate avg depth for each face of the vertices z-value
-        float avg_depth = (transformed_verticies[0].z + transformed_verticies[1].z + transformed_verticies[2].z) / 3.0;
-
-        // Calculate flat shading on triangle
-        float light_intensity_dot = -vec3_dot(normal, global_light.direction);
-        uint32_t triangle_flat_shaded_color = light_apply_intensity(mesh_face.color, light_intensity_dot);
-
-        triangle_t projected_triangle = {
-            .points = {projected_points[0], projected_points[1], projected_points[2]},
-            .texcoords = {
-                {mesh_face.a_uv.u, mesh_face.a_uv.v},
-                {mesh_face.b_uv.u, mesh_face.b_uv.v},
-                {mesh_face.c_uv.u, mesh_face.c_uv.v},
-            },
-            .color = triangle_flat_shaded_color,
-            .avg_depth = avg_depth,
-        };
-
-        // Save the projected triangle in the array of triangles to render
-        array_push(triangles_to_render, projected_triangle);
+    // Draw outline triangle
+    if (render_mode == wireframe || render_mode == wireframe_verbose || render_mode == all)
+    {
+        draw_triangle(
+            triangle->points[0].x,
+            triangle->points[0].y,
+            triangle->points[1].x,
+            triangle->points[1].y,
+            triangle->points[2].x,
+            triangle->points[2].y,
+            0xFFFFFFFF);
     }
 
-    // Sort triangles to render by their avg_depth
-    sort_triangles(triangles_to_render);
+    if (render_mode == wireframe_verbose || render_mode == all)
+    {
+        // Draw vertex points
+        draw_rect(triangle->points[0].x, triangle->points[0].y, 5, 5, 0xFFFF0000);
+        draw_rect(triangle->points[1].x, triangle->points[1].y, 5, 5, 0xFFFF0000);
+        draw_rect(triangle->points[2].x, triangle->points[2].y, 5, 5, 0xFFFF0000);
+    }
 }
 
 void render(void)
 {
     draw_grid();
 
-    // Loop all projected triangles and render them
     int num_triangles = array_length(triangles_to_render);
-    for (int i = 0; i < num_triangles; i++)
-    {
-        triangle_t triangle = triangles_to_render[i];
-
-        if (render_mode == solid || render_mode == all)
-        {
-            // Draw filled triangle
-            draw_filled_triangle(
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[2].x,
-                triangle.points[2].y,
-                triangle.color);
-        }
-
-        if (render_mode == textures || render_mode == all)
-        {
-            // draw_textured_triangle()
-            draw_textured_triangle(
-                // 1
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[0].z,
-                triangle.points[0].w,
-                triangle.texcoords[0].u,
-                triangle.texcoords[0].v,
-
-                // 2
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[1].z,
-                triangle.points[1].w,
-                triangle.texcoords[1].u,
-                triangle.texcoords[1].v,
-
-                // 3
-                triangle.points[2].x,
-                triangle.points[2].y,
-                triangle.points[2].z,
-                triangle.points[2].w,
-                triangle.texcoords[2].u,
-                triangle.texcoords[2].v,
-
-                // Texture
-                mesh_texture);
-        }
 
-        // Draw outline triangle
-        if (render_mode == wireframe || render_mode == wireframe_verbose || render_mode == all)
+    if (is_tiled_rendering_enabled)
+    {
+        // Bin every triangle by its screen bounds, with room for the vertex markers
+        tiles_begin_frame();
+        for (int i = 0; i < num_triangles; i++)
         {
-            draw_triangle(
-                triangle.points[0].x,
-                triangle.points[0].y,
-                triangle.points[1].x,
-                triangle.points[1].y,
-                triangle.points[2].x,
-                triangle.points[2].y,
-                0xFFFFFFFF);
+            int index = triangle_draw_order != NULL ? (int)triangle_draw_order[i].index : i;
+            triangle_t *triangle = &triangles_to_render[index];
+            int x0 = triangle->points[0].x, y0 = triangle->points[0].y;
+            int x1 = triangle->points[1].x, y1 = triangle->points[1].y;
+            int x2 = triangle->points[2].x, y2 = triangle->points[2].y;
+            int min_x = x0 < x1 ? (x0 < x2 ? x0 : x2) : (x1 < x2 ? x1 : x2);
+            int min_y = y0 < y1 ? (y0 < y2 ? y0 : y2) : (y1 < y2 ? y1 : y2);
+            int max_x = x0 > x1 ? (x0 > x2 ? x0 : x2) : (x1 > x2 ? x1 : x2);
+            int max_y = y0 > y1 ? (y0 > y2 ? y0 : y2) : (y1 > y2 ? y1 : y2);
+            tiles_bin(min_x - 1, min_y - 1, max_x + 6, max_y + 6);
         }
 
-        if (render_mode == wireframe_verbose || render_mode == all)
+        // Rasterize the tiles in parallel, each tile still draws back to front
+        tiles_render(draw_render_triangle);
+    }
+    else
+    {
+        // Loop all projected triangles back to front and render them
+        for (int i = 0; i < num_triangles; i++)
         {
-            // Draw vertex points
-            draw_rect(triangle.points[0].x, triangle.points[0].y, 5, 5, 0xFFFF0000);
-            draw_rect(triangle.points[1].x, triangle.points[1].y, 5, 5, 0xFFFF0000);
-            draw_rect(triangle.points[2].x, triangle.points[2].y, 5, 5, 0xFFFF0000);
+            draw_render_triangle(i);
         }
     }
 
@@ -371,9 +434,9 @@ void render(void)
 
 void free_resources(void)
 {
-    array_free(mesh.vertices);
-    array_free(mesh.faces);
-    array_free(triangles_to_render);
+    tiles_destroy();
+    mesh_free(&mesh);
+    arena_free(&frame_arena);
     free(color_buffer);
     free(z_buffer);
     upng_free(png_texture);
@@ -1,6 +1,14 @@
 #include "matrix.h"
 #include <math.h>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <immintrin.h>
+#define MATRIX_SSE
+#if defined(__GNUC__)
+#define MATRIX_AVX2
+#endif
+#endif
+
 mat4_t mat4_identity(void)
 {
     mat4_t m = {
@@ -148,16 +156,7 @@ mat4_t mat4_make_perspective(float fov, float aspect, float znear, float zfar)
 
 vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v)
 {
-    vec4_t result = mat4_mul_vec4(mat_proj, v);
-
-    if (result.w != 0.0)
-    {
-        result.x /= result.w;
-        result.y /= result.w;
-        result.z /= result.w;
-    }
-
-    return result;
+    return vec4_perspective_divide(mat4_mul_vec4(mat_proj, v));
 }
 
 mat4_t mat4_look_at(vec3_t eye_position, vec3_t target, vec3_t up)
@@ -178,4 +177,125 @@ mat4_t mat4_look_at(vec3_t eye_position, vec3_t target, vec3_t up)
     };
 
     return view_matrix;
-}
\ No newline at end of file
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Batched point transform
+///////////////////////////////////////////////////////////////////////////////
+// Transforms count points (x, y, z, 1) read from separate x/y/z streams and
+// writes the results as vec4_t. The SIMD kernels evaluate the same sums in
+// the same order as mat4_mul_vec4, so every path gives identical results.
+///////////////////////////////////////////////////////////////////////////////
+static void transform_points_scalar(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        vec4_t point = {xs[i], ys[i], zs[i], 1};
+        out[i] = mat4_mul_vec4(m, point);
+    }
+}
+
+#ifdef MATRIX_SSE
+static void transform_points_sse(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count)
+{
+    __m128 c[4][4];
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            c[i][j] = _mm_set1_ps(m.m[i][j]);
+        }
+    }
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(xs + i);
+        __m128 y = _mm_loadu_ps(ys + i);
+        __m128 z = _mm_loadu_ps(zs + i);
+
+        __m128 r[4];
+        for (int j = 0; j < 4; j++)
+        {
+            r[j] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c[j][0], x), _mm_mul_ps(c[j][1], y)), _mm_mul_ps(c[j][2], z)), c[j][3]);
+        }
+
+        // Rows of x, y, z, w become one vec4_t per point
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        _mm_storeu_ps(&out[i + 0].x, r[0]);
+        _mm_storeu_ps(&out[i + 1].x, r[1]);
+        _mm_storeu_ps(&out[i + 2].x, r[2]);
+        _mm_storeu_ps(&out[i + 3].x, r[3]);
+    }
+
+    transform_points_scalar(m, xs + i, ys + i, zs + i, out + i, count - i);
+}
+#endif
+
+#ifdef MATRIX_AVX2
+__attribute__((target("avx2"))) static void transform_points_avx2(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count)
+{
+    __m256 c[4][4];
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            c[i][j] = _mm256_set1_ps(m.m[i][j]);
+        }
+    }
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(xs + i);
+        __m256 y = _mm256_loadu_ps(ys + i);
+        __m256 z = _mm256_loadu_ps(zs + i);
+
+        __m256 r[4];
+        for (int j = 0; j < 4; j++)
+        {
+            r[j] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c[j][0], x), _mm256_mul_ps(c[j][1], y)), _mm256_mul_ps(c[j][2], z)), c[j][3]);
+        }
+
+        // Transpose the 4x8 block of x, y, z, w rows into eight vec4_t
+        __m256 xy_lo = _mm256_unpacklo_ps(r[0], r[1]); // x0 y0 x1 y1 | x4 y4 x5 y5
+        __m256 xy_hi = _mm256_unpackhi_ps(r[0], r[1]); // x2 y2 x3 y3 | x6 y6 x7 y7
+        __m256 zw_lo = _mm256_unpacklo_ps(r[2], r[3]);
+        __m256 zw_hi = _mm256_unpackhi_ps(r[2], r[3]);
+        __m256 p04 = _mm256_shuffle_ps(xy_lo, zw_lo, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p15 = _mm256_shuffle_ps(xy_lo, zw_lo, _MM_SHUFFLE(3, 2, 3, 2));
+        __m256 p26 = _mm256_shuffle_ps(xy_hi, zw_hi, _MM_SHUFFLE(1, 0, 1, 0));
+        __m256 p37 = _mm256_shuffle_ps(xy_hi, zw_hi, _MM_SHUFFLE(3, 2, 3, 2));
+        _mm256_storeu_ps(&out[i + 0].x, _mm256_permute2f128_ps(p04, p15, 0x20));
+        _mm256_storeu_ps(&out[i + 2].x, _mm256_permute2f128_ps(p26, p37, 0x20));
+        _mm256_storeu_ps(&out[i + 4].x, _mm256_permute2f128_ps(p04, p15, 0x31));
+        _mm256_storeu_ps(&out[i + 6].x, _mm256_permute2f128_ps(p26, p37, 0x31));
+    }
+
+    transform_points_scalar(m, xs + i, ys + i, zs + i, out + i, count - i);
+}
+#endif
+
+typedef void (*transform_points_fn)(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count);
+
+// Kernel in use for the batched transform, init_transform_kernels upgrades it to the
+// widest the CPU supports
+static transform_points_fn transform_points = transform_points_scalar;
+
+void init_transform_kernels(bool has_sse2, bool has_avx2)
+{
+    transform_points = transform_points_scalar;
+#ifdef MATRIX_SSE
+    if (has_sse2)
+        transform_points = transform_points_sse;
+#endif
+#ifdef MATRIX_AVX2
+    if (has_avx2)
+        transform_points = transform_points_avx2;
+#endif
+}
+
+void mat4_transform_points(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count)
+{
+    transform_points(m, xs, ys, zs, out, count);
+}
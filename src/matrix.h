@@ -1,6 +1,7 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <stdbool.h>
 #include "vector.h"
 
 typedef struct
@@ -20,5 +21,7 @@ vec4_t mat4_mul_vec4_project(mat4_t mat_proj, vec4_t v);
 
 mat4_t mat4_mul_mat4(mat4_t a, mat4_t b);
 vec4_t mat4_mul_vec4(mat4_t m, vec4_t v);
+void init_transform_kernels(bool has_sse2, bool has_avx2);
+void mat4_transform_points(mat4_t m, const float *xs, const float *ys, const float *zs, vec4_t *out, int count);
 
 #endif
\ No newline at end of file
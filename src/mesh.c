@@ -1,8 +1,11 @@
 #include "mesh.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "array.h"
+#include "mesh_cache.h"
 
 vec3_t cube_vertices[N_CUBE_VERTICES] = {
     {.x = -1, .y = -1, .z = -1}, // 1
@@ -15,96 +18,1047 @@ vec3_t cube_vertices[N_CUBE_VERTICES] = {
     {.x = -1, .y = -1, .z = 1}   // 8
 };
 
-face_t cube_faces[N_CUBE_FACES] = {
+tex2_t cube_texcoords[N_CUBE_TEXCOORDS] = {
+    {0, 1}, // 1
+    {0, 0}, // 2
+    {1, 0}, // 3
+    {1, 1}  // 4
+};
+
+face_corner_t cube_faces[N_CUBE_FACES][3] = {
     // front
-    {.a = 1, .b = 2, .c = 3, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 1, .b = 3, .c = 4, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{1, 1}, {2, 2}, {3, 3}},
+    {{1, 1}, {3, 3}, {4, 4}},
     // right
-    {.a = 4, .b = 3, .c = 5, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 4, .b = 5, .c = 6, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{4, 1}, {3, 2}, {5, 3}},
+    {{4, 1}, {5, 3}, {6, 4}},
     // back
-    {.a = 6, .b = 5, .c = 7, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 6, .b = 7, .c = 8, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{6, 1}, {5, 2}, {7, 3}},
+    {{6, 1}, {7, 3}, {8, 4}},
     // left
-    {.a = 8, .b = 7, .c = 2, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 8, .b = 2, .c = 1, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{8, 1}, {7, 2}, {2, 3}},
+    {{8, 1}, {2, 3}, {1, 4}},
     // top
-    {.a = 2, .b = 7, .c = 5, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 2, .b = 5, .c = 3, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{2, 1}, {7, 2}, {5, 3}},
+    {{2, 1}, {5, 3}, {3, 4}},
     // bottom
-    {.a = 6, .b = 8, .c = 1, .a_uv = {0, 1}, .b_uv = {0, 0}, .c_uv = {1, 0}, .color = 0xFFFFFFFF},
-    {.a = 6, .b = 1, .c = 4, .a_uv = {0, 1}, .b_uv = {1, 0}, .c_uv = {1, 1}, .color = 0xFFFFFFFF},
+    {{6, 1}, {8, 2}, {1, 3}},
+    {{6, 1}, {1, 3}, {4, 4}},
 };
 
+static void mesh_finish_loading(mesh_t *mesh);
+
 mesh_t mesh = {
     .vertices = NULL,
+    .texcoords = NULL,
     .faces = NULL,
     .rotation = {.x = 0, .y = 0, .z = 0},
     .scale = {1, 1, 1},
     .translation = {0, 0, 0},
+    .vertex_streams = {NULL, NULL, NULL, 0, NULL},
+    .bounds = {{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, 0},
+    .face_normals = NULL,
+    .clusters = NULL,
+    .visible_faces = NULL,
+    .num_visible_faces = 0,
+    .visible_clusters = NULL,
+    .num_visible_clusters = 0,
+    .is_vertex_visible = NULL,
+    .transform = {
+        .is_world_dirty = true,
+        .is_model_view_dirty = true,
+    },
+    .view_vertices = NULL,
+    .clip_vertices = NULL,
+    .cache = {NULL, 0},
 };
 
-void load_cube_mesh_data(void)
+///////////////////////////////////////////////////////////////////////////////
+// Welds face corners into mesh vertices
+///////////////////////////////////////////////////////////////////////////////
+// Files index positions and texture coordinates separately, the mesh has one
+// index per vertex. Every distinct (position, texcoord) pair becomes a vertex
+// once, so its transform is shared by all the faces around it and only seams
+// duplicate positions. Pairs are looked up in an open addressing hash table
+// sized for every corner being distinct, so it never grows, and the vertex
+// arrays are allocated once the number of distinct pairs is known.
+///////////////////////////////////////////////////////////////////////////////
+static void weld_faces(mesh_t *mesh, const face_corner_t *corners, int num_faces, const vec3_t *positions, const tex2_t *texcoords)
 {
-    for (int i = 0; i < N_CUBE_VERTICES; i++)
+    // Keep the table at most half full
+    int capacity = 16;
+    while (capacity < 2 * 3 * num_faces)
+        capacity *= 2;
+
+    face_corner_t *keys = malloc(sizeof(face_corner_t) * capacity);
+    int *slot_vertices = malloc(sizeof(int) * capacity); // Mesh vertex of every slot, -1 when empty
+    for (int i = 0; i < capacity; i++)
+        slot_vertices[i] = -1;
+
+    mesh->faces = array_hold(NULL, num_faces, sizeof(face_t));
+    int num_vertices = 0;
+
+    for (int f = 0; f < num_faces; f++)
     {
-        array_push(mesh.vertices, cube_vertices[i]);
+        int indices[3];
+        for (int k = 0; k < 3; k++)
+        {
+            face_corner_t corner = corners[3 * f + k];
+            uint32_t hash = (uint32_t)corner.position * 73856093u ^ (uint32_t)corner.texcoord * 19349663u;
+            int slot = hash & (capacity - 1);
+            while (slot_vertices[slot] >= 0 &&
+                   (keys[slot].position != corner.position || keys[slot].texcoord != corner.texcoord))
+            {
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            if (slot_vertices[slot] < 0)
+            {
+                keys[slot] = corner;
+                slot_vertices[slot] = num_vertices++;
+            }
+            indices[k] = slot_vertices[slot];
+        }
+
+        mesh->faces[f] = (face_t){.a = indices[0], .b = indices[1], .c = indices[2], .color = 0xFFFFFFFF};
     }
 
-    for (int i = 0; i < N_CUBE_FACES; i++)
+    mesh->vertices = array_hold(NULL, num_vertices, sizeof(vec3_t));
+    mesh->texcoords = array_hold(NULL, num_vertices, sizeof(tex2_t));
+    for (int i = 0; i < capacity; i++)
     {
-        array_push(mesh.faces, cube_faces[i]);
+        int vertex = slot_vertices[i];
+        if (vertex < 0)
+            continue;
+
+        mesh->vertices[vertex] = positions[keys[i].position - 1];
+        mesh->texcoords[vertex] = keys[i].texcoord > 0 ? texcoords[keys[i].texcoord - 1] : (tex2_t){0, 0};
     }
+
+    free(keys);
+    free(slot_vertices);
+}
+
+void load_cube_mesh_data(void)
+{
+    weld_faces(&mesh, &cube_faces[0][0], N_CUBE_FACES, cube_vertices, cube_texcoords);
+    mesh_finish_loading(&mesh);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Loads an OBJ file, through the binary cache next to it when that is current
+///////////////////////////////////////////////////////////////////////////////
+// The first load of a file parses it and writes filename.cache, later loads
+// map that cache as long as the hash of the file still matches.
+///////////////////////////////////////////////////////////////////////////////
 void load_obj_file_data(char *filename)
 {
-    FILE *file;
-    file = fopen(filename, "r");
-    char line[1024];
+    mapped_file_t source;
+    if (!map_file(filename, &source))
+    {
+        fprintf(stderr, "Error opening %s.\n", filename);
+        return;
+    }
+    uint64_t source_size = source.size;
+    uint64_t source_hash = hash_bytes(source.data, source.size);
+    unmap_file(&source);
+
+    char cache_filename[1024];
+    snprintf(cache_filename, sizeof(cache_filename), "%s.cache", filename);
+
+    if (!mesh_cache_load(&mesh, cache_filename, source_size, source_hash))
+    {
+        obj_data_t obj;
+        if (!obj_parse_file(filename, &obj))
+            return;
+
+        weld_faces(&mesh, obj.corners, array_length(obj.corners) / 3, obj.positions, obj.texcoords);
+        obj_free(&obj);
+
+        mesh_finish_loading(&mesh);
+        mesh_cache_write(&mesh, cache_filename, source_size, source_hash);
+    }
+}
+
+static bool vec3_equals(vec3_t a, vec3_t b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static bool mat4_equals(mat4_t a, mat4_t b)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            if (a.m[i][j] != b.m[i][j])
+                return false;
+        }
+    }
+    return true;
+}
+
+// Aligns p up to the next multiple of VERTEX_STREAM_ALIGNMENT bytes
+#define VERTEX_STREAM_ALIGNMENT 32
+#define ALIGN_UP(p) (((uintptr_t)(p) + VERTEX_STREAM_ALIGNMENT - 1) & ~(uintptr_t)(VERTEX_STREAM_ALIGNMENT - 1))
+
+void mesh_build_vertex_streams(mesh_t *mesh)
+{
+    vertex_streams_t *streams = &mesh->vertex_streams;
+    int num_vertices = array_length(mesh->vertices);
+
+    free(streams->memory);
+
+    // Pad every stream to a whole number of 8-float SIMD registers so each one starts aligned
+    int stride = (num_vertices + 7) & ~7;
+    streams->memory = malloc(sizeof(float) * stride * 3 + VERTEX_STREAM_ALIGNMENT);
+    streams->x = (float *)ALIGN_UP(streams->memory);
+    streams->y = streams->x + stride;
+    streams->z = streams->y + stride;
+    streams->count = num_vertices;
+
+    for (int i = 0; i < num_vertices; i++)
+    {
+        streams->x[i] = mesh->vertices[i].x;
+        streams->y[i] = mesh->vertices[i].y;
+        streams->z[i] = mesh->vertices[i].z;
+    }
+}
+
+// Normalizes v, leaving degenerate zero length vectors at zero
+static vec3_t vec3_normalized_or_zero(vec3_t v)
+{
+    float length = vec3_length(v);
+    return length > 0 ? vec3_div(v, length) : v;
+}
+
+// Sphere around the center of the box of the given vertices, just big enough to hold them all
+static void bounding_sphere(const vec3_t *vertices, const int *indices, int count, vec3_t *center, float *radius)
+{
+    vec3_t min = vertices[indices[0]];
+    vec3_t max = min;
+    for (int i = 1; i < count; i++)
+    {
+        vec3_t v = vertices[indices[i]];
+        min.x = fminf(min.x, v.x);
+        min.y = fminf(min.y, v.y);
+        min.z = fminf(min.z, v.z);
+        max.x = fmaxf(max.x, v.x);
+        max.y = fmaxf(max.y, v.y);
+        max.z = fmaxf(max.z, v.z);
+    }
+
+    *center = vec3_mul(vec3_add(min, max), 0.5);
+    float radius_squared = 0;
+    for (int i = 0; i < count; i++)
+    {
+        vec3_t offset = vec3_sub(vertices[indices[i]], *center);
+        radius_squared = fmaxf(radius_squared, vec3_dot(offset, offset));
+    }
+    *radius = sqrtf(radius_squared);
+}
+
+void mesh_compute_bounds(mesh_t *mesh)
+{
+    bounds_t *bounds = &mesh->bounds;
+    int num_vertices = array_length(mesh->vertices);
+
+    if (num_vertices == 0)
+    {
+        *bounds = (bounds_t){{0, 0, 0}, {0, 0, 0}, {0, 0, 0}, 0};
+        return;
+    }
+
+    bounds->min = mesh->vertices[0];
+    bounds->max = mesh->vertices[0];
+    for (int i = 1; i < num_vertices; i++)
+    {
+        vec3_t v = mesh->vertices[i];
+        bounds->min.x = fminf(bounds->min.x, v.x);
+        bounds->min.y = fminf(bounds->min.y, v.y);
+        bounds->min.z = fminf(bounds->min.z, v.z);
+        bounds->max.x = fmaxf(bounds->max.x, v.x);
+        bounds->max.y = fmaxf(bounds->max.y, v.y);
+        bounds->max.z = fmaxf(bounds->max.z, v.z);
+    }
+
+    // Sphere around the center of the box, just big enough to hold every vertex
+    bounds->center = vec3_mul(vec3_add(bounds->min, bounds->max), 0.5);
+    float radius_squared = 0;
+    for (int i = 0; i < num_vertices; i++)
+    {
+        vec3_t offset = vec3_sub(mesh->vertices[i], bounds->center);
+        radius_squared = fmaxf(radius_squared, vec3_dot(offset, offset));
+    }
+    bounds->radius = sqrtf(radius_squared);
+}
+
+void mesh_compute_face_normals(mesh_t *mesh)
+{
+    int num_faces = array_length(mesh->faces);
+
+    array_free(mesh->face_normals);
+    mesh->face_normals = array_hold(NULL, num_faces, sizeof(vec3_t));
+
+    for (int i = 0; i < num_faces; i++)
+    {
+        vec3_t a = mesh->vertices[mesh->faces[i].a];
+        vec3_t b = mesh->vertices[mesh->faces[i].b];
+        vec3_t c = mesh->vertices[mesh->faces[i].c];
+        mesh->face_normals[i] = vec3_normalized_or_zero(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+    }
+}
+
+// Vertices qsort compares through, qsort takes no context of its own
+static const vec3_t *position_sort_vertices = NULL;
+
+static int compare_vertex_positions(const void *a, const void *b)
+{
+    vec3_t va = position_sort_vertices[*(const int *)a];
+    vec3_t vb = position_sort_vertices[*(const int *)b];
+    if (va.x != vb.x)
+        return va.x < vb.x ? -1 : 1;
+    if (va.y != vb.y)
+        return va.y < vb.y ? -1 : 1;
+    if (va.z != vb.z)
+        return va.z < vb.z ? -1 : 1;
+    return 0;
+}
+
+// Gives vertices at the same position the same id, so faces split apart along
+// UV seams or hard edges still count as neighbours. Free the result.
+static int *vertex_position_ids(const vec3_t *vertices, int num_vertices)
+{
+    int *sorted = malloc(sizeof(int) * (num_vertices + 1));
+    int *ids = malloc(sizeof(int) * (num_vertices + 1));
+    for (int v = 0; v < num_vertices; v++)
+        sorted[v] = v;
+
+    position_sort_vertices = vertices;
+    qsort(sorted, num_vertices, sizeof(int), compare_vertex_positions);
+
+    int id = -1;
+    for (int i = 0; i < num_vertices; i++)
+    {
+        if (i == 0 || compare_vertex_positions(&sorted[i - 1], &sorted[i]) != 0)
+            id++;
+        ids[sorted[i]] = id;
+    }
+
+    free(sorted);
+    return ids;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Splits the faces into clusters of up to MESH_CLUSTER_MAX_FACES neighbours
+///////////////////////////////////////////////////////////////////////////////
+// A cluster grows from a seed face over faces sharing a vertex position. It
+// prefers neighbours whose normal is within 60 degrees of the average normal
+// of the faces taken so far, which keeps its normal cone narrow enough to be
+// culled, and among those the one with the most corners already in the
+// cluster, then the one closest to its center, so it stays round and its
+// bounding sphere tight. It ends when it is full, or when no neighbour fits
+// the cone once it has CLUSTER_MIN_FACES: below that it takes the neighbour
+// closest to fitting instead, small clusters cost a test each and save
+// little. The next cluster starts from a face left on the border of the last
+// one, so the clusters tile the surface in order. Faces and their normals are
+// reordered so every cluster is a contiguous range, mesh_optimize_vertex_cache
+// then orders the faces inside each one. Needs mesh_compute_face_normals.
+///////////////////////////////////////////////////////////////////////////////
+
+// Cosine of the largest angle between a new face of a cluster and the average normal of the others
+#define CLUSTER_MIN_NORMAL_DOT 0.5f
+
+// Faces a cluster takes even when their normals widen its cone past that
+#define CLUSTER_MIN_FACES (MESH_CLUSTER_MAX_FACES / 2)
+
+void mesh_build_clusters(mesh_t *mesh)
+{
+    int num_faces = array_length(mesh->faces);
+    int num_vertices = array_length(mesh->vertices);
+
+    array_free(mesh->clusters);
+    mesh->clusters = NULL;
+
+    if (num_faces <= 0)
+        return;
+
+    // Faces around position p are vertex_faces[vertex_offsets[p]] .. vertex_faces[vertex_offsets[p + 1] - 1]
+    int *position_ids = vertex_position_ids(mesh->vertices, num_vertices);
+    int *vertex_offsets = calloc(num_vertices + 1, sizeof(int));
+    int *vertex_cursors = malloc(sizeof(int) * (num_vertices + 1));
+    int *vertex_faces = malloc(sizeof(int) * 3 * num_faces);
+    for (int i = 0; i < num_faces; i++)
+    {
+        vertex_offsets[position_ids[mesh->faces[i].a] + 1]++;
+        vertex_offsets[position_ids[mesh->faces[i].b] + 1]++;
+        vertex_offsets[position_ids[mesh->faces[i].c] + 1]++;
+    }
+    for (int v = 0; v < num_vertices; v++)
+    {
+        vertex_offsets[v + 1] += vertex_offsets[v];
+        vertex_cursors[v] = vertex_offsets[v];
+    }
+    for (int i = 0; i < num_faces; i++)
+    {
+        vertex_faces[vertex_cursors[position_ids[mesh->faces[i].a]]++] = i;
+        vertex_faces[vertex_cursors[position_ids[mesh->faces[i].b]]++] = i;
+        vertex_faces[vertex_cursors[position_ids[mesh->faces[i].c]]++] = i;
+    }
+
+    vec3_t *centroids = malloc(sizeof(vec3_t) * num_faces);
+    for (int i = 0; i < num_faces; i++)
+    {
+        vec3_t a = mesh->vertices[mesh->faces[i].a];
+        vec3_t b = mesh->vertices[mesh->faces[i].b];
+        vec3_t c = mesh->vertices[mesh->faces[i].c];
+        centroids[i] = vec3_div(vec3_add(vec3_add(a, b), c), 3);
+    }
+
+    int *order = malloc(sizeof(int) * num_faces); // Old index of the face at every new position
+    int *border = malloc(sizeof(int) * num_faces); // Faces next to the growing cluster, in no order
+    bool *is_taken = calloc(num_faces, sizeof(bool));
+    bool *is_on_border = calloc(num_faces, sizeof(bool));
+    int *position_clusters = malloc(sizeof(int) * (num_vertices + 1)); // Last cluster that took a face around each position
+    for (int v = 0; v < num_vertices; v++)
+        position_clusters[v] = -1;
+
+    int num_ordered = 0;
+    int next_in_file = 0;
+    int seed = 0;
+
+    while (seed >= 0)
+    {
+        int cluster_index = array_length(mesh->clusters);
+        cluster_t cluster = {.first_face = num_ordered, .num_faces = 0};
+        vec3_t normal_sum = {0, 0, 0};
+        vec3_t centroid_sum = {0, 0, 0};
+
+        int num_border = 0;
+        border[num_border++] = seed;
+        is_on_border[seed] = true;
+
+        while (cluster.num_faces < MESH_CLUSTER_MAX_FACES)
+        {
+            // Rank the bordering faces as described above, ties go to the lower cost
+            vec3_t axis = vec3_normalized_or_zero(normal_sum);
+            vec3_t center = cluster.num_faces > 0 ? vec3_div(centroid_sum, cluster.num_faces) : centroids[seed];
+            int best = -1;
+            int best_rank = -1;
+            float best_cost = INFINITY;
+            for (int j = 0; j < num_border; j++)
+            {
+                int g = border[j];
+                float alignment = vec3_dot(mesh->face_normals[g], axis);
+                bool is_fitting = cluster.num_faces == 0 || alignment >= CLUSTER_MIN_NORMAL_DOT;
+                if (!is_fitting && cluster.num_faces >= CLUSTER_MIN_FACES)
+                    continue;
+
+                int rank = 0;
+                float cost = -alignment;
+                if (is_fitting)
+                {
+                    rank = 1 + (position_clusters[position_ids[mesh->faces[g].a]] == cluster_index) +
+                           (position_clusters[position_ids[mesh->faces[g].b]] == cluster_index) +
+                           (position_clusters[position_ids[mesh->faces[g].c]] == cluster_index);
+                    vec3_t offset = vec3_sub(centroids[g], center);
+                    cost = vec3_dot(offset, offset);
+                }
+                if (rank > best_rank || (rank == best_rank && cost < best_cost))
+                {
+                    best_rank = rank;
+                    best_cost = cost;
+                    best = j;
+                }
+            }
+            if (best < 0)
+                break;
+
+            int f = border[best];
+            border[best] = border[--num_border];
+            is_taken[f] = true;
+            order[num_ordered++] = f;
+            cluster.num_faces++;
+            normal_sum = vec3_add(normal_sum, mesh->face_normals[f]);
+            centroid_sum = vec3_add(centroid_sum, centroids[f]);
+
+            int corners[3] = {position_ids[mesh->faces[f].a], position_ids[mesh->faces[f].b], position_ids[mesh->faces[f].c]};
+            for (int k = 0; k < 3; k++)
+            {
+                position_clusters[corners[k]] = cluster_index;
+                for (int j = vertex_offsets[corners[k]]; j < vertex_offsets[corners[k] + 1]; j++)
+                {
+                    int g = vertex_faces[j];
+                    if (!is_taken[g] && !is_on_border[g])
+                    {
+                        is_on_border[g] = true;
+                        border[num_border++] = g;
+                    }
+                }
+            }
+        }
+
+        array_push(mesh->clusters, cluster);
+
+        // Go on from a face this cluster left on its border, or the next one in the file once the part is done
+        seed = num_border > 0 ? border[0] : -1;
+        for (int j = 0; j < num_border; j++)
+            is_on_border[border[j]] = false;
+        while (seed < 0 && next_in_file < num_faces)
+        {
+            if (!is_taken[next_in_file])
+                seed = next_in_file;
+            next_in_file++;
+        }
+    }
+
+    // Move the faces and their normals into cluster order
+    face_t *faces = array_hold(NULL, num_faces, sizeof(face_t));
+    vec3_t *face_normals = array_hold(NULL, num_faces, sizeof(vec3_t));
+    for (int i = 0; i < num_faces; i++)
+    {
+        faces[i] = mesh->faces[order[i]];
+        face_normals[i] = mesh->face_normals[order[i]];
+    }
+    array_free(mesh->faces);
+    array_free(mesh->face_normals);
+    mesh->faces = faces;
+    mesh->face_normals = face_normals;
+
+    // Bounds and normal cone of every cluster, the adjacency is done with and its buffer holds the corners
+    int *corners = vertex_faces;
+
+    int num_clusters = array_length(mesh->clusters);
+    for (int c = 0; c < num_clusters; c++)
+    {
+        cluster_t *cluster = &mesh->clusters[c];
+        face_t *cluster_faces = &mesh->faces[cluster->first_face];
+        vec3_t *normals = &mesh->face_normals[cluster->first_face];
+
+        for (int i = 0; i < cluster->num_faces; i++)
+        {
+            corners[3 * i + 0] = cluster_faces[i].a;
+            corners[3 * i + 1] = cluster_faces[i].b;
+            corners[3 * i + 2] = cluster_faces[i].c;
+        }
+        bounding_sphere(mesh->vertices, corners, 3 * cluster->num_faces, &cluster->center, &cluster->radius);
+
+        // Cone around the average normal wide enough for all of them
+        vec3_t axis = {0, 0, 0};
+        for (int i = 0; i < cluster->num_faces; i++)
+        {
+            axis = vec3_add(axis, normals[i]);
+        }
+        cluster->cone_axis = vec3_normalized_or_zero(axis);
+
+        float min_dot = 1;
+        for (int i = 0; i < cluster->num_faces; i++)
+        {
+            min_dot = fminf(min_dot, vec3_dot(cluster->cone_axis, normals[i]));
+        }
+        cluster->cone_cutoff = min_dot > 0 ? sqrtf(1 - min_dot * min_dot) : 1;
+    }
+
+    free(position_ids);
+    free(vertex_offsets);
+    free(vertex_cursors);
+    free(vertex_faces);
+    free(centroids);
+    free(order);
+    free(border);
+    free(is_taken);
+    free(is_on_border);
+    free(position_clusters);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reorders the faces for vertex reuse (Tipsify)
+///////////////////////////////////////////////////////////////////////////////
+// Tipsify (Sander, Nehab and Barczak 2007) fans around one vertex at a time
+// and picks the next one among the vertices just used, preferring those still
+// in a cache of VERTEX_CACHE_SIZE that have few faces left. Faces then keep
+// coming back to the same handful of vertices, which is what the indexed
+// fetches in update() see. Faces only move inside their cluster, one cluster
+// after the other with the cache carried over, so the clusters stay intact.
+// Needs mesh_build_clusters and keeps the face normals in step.
+///////////////////////////////////////////////////////////////////////////////
+
+#define VERTEX_CACHE_SIZE 16
+
+void mesh_optimize_vertex_cache(mesh_t *mesh)
+{
+    int num_vertices = array_length(mesh->vertices);
+    int num_faces = array_length(mesh->faces);
+
+    // Faces around each vertex
+    int *offsets = calloc(num_vertices + 1, sizeof(int));
+    int *adjacency = malloc(sizeof(int) * (3 * num_faces + 1));
+    int *live_faces = malloc(sizeof(int) * (num_vertices + 1));
+    int *cache_time = calloc(num_vertices + 1, sizeof(int));
+    int *dead_ends = malloc(sizeof(int) * (3 * num_faces + 1));
+    bool *is_emitted = calloc(num_faces + 1, sizeof(bool));
+    int *order = malloc(sizeof(int) * (num_faces + 1));
+
+    for (int i = 0; i < num_faces; i++)
+    {
+        offsets[mesh->faces[i].a + 1]++;
+        offsets[mesh->faces[i].b + 1]++;
+        offsets[mesh->faces[i].c + 1]++;
+    }
+    for (int v = 0; v < num_vertices; v++)
+    {
+        offsets[v + 1] += offsets[v];
+        live_faces[v] = 0;
+    }
+    for (int i = 0; i < num_faces; i++)
+    {
+        int corners[3] = {mesh->faces[i].a, mesh->faces[i].b, mesh->faces[i].c};
+        for (int k = 0; k < 3; k++)
+            adjacency[offsets[corners[k]] + live_faces[corners[k]]++] = i;
+    }
+    for (int v = 0; v < num_vertices; v++)
+        live_faces[v] = 0;
+
+    int num_ordered = 0;
+    int time = VERTEX_CACHE_SIZE + 1;
+
+    int num_clusters = array_length(mesh->clusters);
+    for (int c = 0; c < num_clusters; c++)
+    {
+        int first = mesh->clusters[c].first_face;
+        int end = first + mesh->clusters[c].num_faces;
+
+        // Only the faces of this cluster count as left, those of the clusters before are all emitted
+        for (int i = first; i < end; i++)
+        {
+            live_faces[mesh->faces[i].a]++;
+            live_faces[mesh->faces[i].b]++;
+            live_faces[mesh->faces[i].c]++;
+        }
+
+        int num_dead_ends = 0;
+        int cursor = first;
+        int fan_vertex = mesh->faces[first].a;
+
+        while (fan_vertex >= 0)
+        {
+            // Emit every face of the cluster left around the fanning vertex, the
+            // candidates for the next fan are the vertices it just pushed on the dead end stack
+            int first_candidate = num_dead_ends;
+            for (int j = offsets[fan_vertex]; j < offsets[fan_vertex + 1]; j++)
+            {
+                int f = adjacency[j];
+                if (f < first || f >= end || is_emitted[f])
+                    continue;
+
+                int corners[3] = {mesh->faces[f].a, mesh->faces[f].b, mesh->faces[f].c};
+                for (int k = 0; k < 3; k++)
+                {
+                    int v = corners[k];
+                    dead_ends[num_dead_ends++] = v;
+                    live_faces[v]--;
+                    if (time - cache_time[v] > VERTEX_CACHE_SIZE)
+                        cache_time[v] = time++;
+                }
+                is_emitted[f] = true;
+                order[num_ordered++] = f;
+            }
+
+            // Fan next around the used vertex that will still be cached after its remaining faces, oldest first
+            fan_vertex = -1;
+            int best_priority = -1;
+            for (int d = first_candidate; d < num_dead_ends; d++)
+            {
+                int v = dead_ends[d];
+                if (live_faces[v] <= 0)
+                    continue;
+
+                int priority = 0;
+                if (time - cache_time[v] + 2 * live_faces[v] <= VERTEX_CACHE_SIZE)
+                    priority = time - cache_time[v];
+                if (priority > best_priority)
+                {
+                    best_priority = priority;
+                    fan_vertex = v;
+                }
+            }
+
+            // Dead end, back up to a recently used vertex with faces left, or a face of the cluster not emitted yet
+            while (fan_vertex < 0 && num_dead_ends > 0)
+            {
+                int v = dead_ends[--num_dead_ends];
+                if (live_faces[v] > 0)
+                    fan_vertex = v;
+            }
+            while (fan_vertex < 0 && cursor < end)
+            {
+                if (!is_emitted[cursor])
+                    fan_vertex = mesh->faces[cursor].a;
+                cursor++;
+            }
+        }
+    }
+
+    face_t *faces = array_hold(NULL, num_faces, sizeof(face_t));
+    vec3_t *normals = array_hold(NULL, num_faces, sizeof(vec3_t));
+    for (int i = 0; i < num_faces; i++)
+    {
+        faces[i] = mesh->faces[order[i]];
+        normals[i] = mesh->face_normals[order[i]];
+    }
+    array_free(mesh->faces);
+    array_free(mesh->face_normals);
+    mesh->faces = faces;
+    mesh->face_normals = normals;
+
+    free(offsets);
+    free(adjacency);
+    free(live_faces);
+    free(cache_time);
+    free(dead_ends);
+    free(is_emitted);
+    free(order);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Renumbers the vertices in the order the faces first use them
+///////////////////////////////////////////////////////////////////////////////
+// Vertices fetched close together in time then sit close together in memory,
+// and the vertices of neighbouring visible clusters form the long contiguous
+// runs mesh_transform_vertices batches. Unused vertices move to the end.
+///////////////////////////////////////////////////////////////////////////////
+void mesh_optimize_vertex_fetch(mesh_t *mesh)
+{
+    int num_vertices = array_length(mesh->vertices);
+    int num_faces = array_length(mesh->faces);
+
+    int *remap = malloc(sizeof(int) * (num_vertices + 1));
+    for (int v = 0; v < num_vertices; v++)
+        remap[v] = -1;
+
+    vec3_t *vertices = array_hold(NULL, num_vertices, sizeof(vec3_t));
+    tex2_t *texcoords = array_hold(NULL, num_vertices, sizeof(tex2_t));
+    int next = 0;
+    for (int i = 0; i < num_faces; i++)
+    {
+        int *corners[3] = {&mesh->faces[i].a, &mesh->faces[i].b, &mesh->faces[i].c};
+        for (int k = 0; k < 3; k++)
+        {
+            if (remap[*corners[k]] < 0)
+            {
+                remap[*corners[k]] = next;
+                vertices[next] = mesh->vertices[*corners[k]];
+                texcoords[next++] = mesh->texcoords[*corners[k]];
+            }
+            *corners[k] = remap[*corners[k]];
+        }
+    }
+    for (int v = 0; v < num_vertices; v++)
+    {
+        if (remap[v] < 0)
+        {
+            vertices[next] = mesh->vertices[v];
+            texcoords[next++] = mesh->texcoords[v];
+        }
+    }
+
+    array_free(mesh->vertices);
+    array_free(mesh->texcoords);
+    mesh->vertices = vertices;
+    mesh->texcoords = texcoords;
+    free(remap);
+}
+
+// Builds everything derived from the vertices and faces, in dependency order
+static void mesh_finish_loading(mesh_t *mesh)
+{
+    mesh_compute_face_normals(mesh);
+    mesh_build_clusters(mesh);
+    mesh_optimize_vertex_cache(mesh);
+    mesh_optimize_vertex_fetch(mesh);
+    mesh_build_vertex_streams(mesh);
+    mesh_compute_bounds(mesh);
+}
+
+void mesh_update_transform(mesh_t *mesh, mat4_t view_matrix)
+{
+    transform_t *transform = &mesh->transform;
+
+    // Flag the cached matrices as dirty when any of their inputs changed since last frame
+    if (!vec3_equals(transform->rotation, mesh->rotation) ||
+        !vec3_equals(transform->scale, mesh->scale) ||
+        !vec3_equals(transform->translation, mesh->translation))
+    {
+        transform->is_world_dirty = true;
+    }
+
+    if (!mat4_equals(transform->view_matrix, view_matrix))
+    {
+        transform->is_model_view_dirty = true;
+    }
+
+    if (transform->is_world_dirty)
+    {
+        // Create a world matrix combining scale, rotation, and translation
+        mat4_t world_matrix = mat4_make_scale(mesh->scale.x, mesh->scale.y, mesh->scale.z);
+        world_matrix = mat4_mul_mat4(mat4_make_rotation_x(mesh->rotation.x), world_matrix);
+        world_matrix = mat4_mul_mat4(mat4_make_rotation_y(mesh->rotation.y), world_matrix);
+        world_matrix = mat4_mul_mat4(mat4_make_rotation_z(mesh->rotation.z), world_matrix);
+        world_matrix = mat4_mul_mat4(mat4_make_translation(mesh->translation.x, mesh->translation.y, mesh->translation.z), world_matrix);
+
+        transform->world_matrix = world_matrix;
+        transform->rotation = mesh->rotation;
+        transform->scale = mesh->scale;
+        transform->translation = mesh->translation;
+        transform->is_world_dirty = false;
+        transform->is_model_view_dirty = true;
+    }
+
+    if (transform->is_model_view_dirty)
+    {
+        transform->model_view_matrix = mat4_mul_mat4(view_matrix, transform->world_matrix);
+        transform->view_matrix = view_matrix;
+        transform->is_model_view_dirty = false;
+    }
+}
+
+// Brings a world space point into model space, undoing translation, rotation and scale
+static vec3_t mesh_world_to_model(mesh_t *mesh, vec3_t point)
+{
+    // The upper 3x3 of the world matrix is R * S, its inverse is S^-1 * R^T and
+    // R^T is the transposed world matrix with column j divided by scale j
+    mat4_t m = mesh->transform.world_matrix;
+    vec3_t scale = mesh->transform.scale;
+    vec3_t p = {point.x - m.m[0][3], point.y - m.m[1][3], point.z - m.m[2][3]};
+
+    vec3_t result = {
+        (m.m[0][0] * p.x + m.m[1][0] * p.y + m.m[2][0] * p.z) / (scale.x * scale.x),
+        (m.m[0][1] * p.x + m.m[1][1] * p.y + m.m[2][1] * p.z) / (scale.y * scale.y),
+        (m.m[0][2] * p.x + m.m[1][2] * p.y + m.m[2][2] * p.z) / (scale.z * scale.z),
+    };
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Collects the faces pointing towards the camera and marks the vertices they use
+///////////////////////////////////////////////////////////////////////////////
+// Whole clusters are rejected first, by their bounding sphere against the
+// frustum and by their normal cone, before any of their faces is looked at.
+// Culling happens in model space with the normals from load, the camera is
+// brought into model space once instead. Which side of a face plane a point is
+// on survives the trip through the world matrix, unless it mirrors the mesh.
+// Needs mesh_update_transform, mesh_transform_vertices then only transforms
+// the marked vertices.
+///////////////////////////////////////////////////////////////////////////////
+void mesh_select_visible_faces(mesh_t *mesh, vec3_t camera_position, mat4_t projection_matrix,
+                               frustum_test_t mesh_visibility, bool is_culling_enabled)
+{
+    int num_faces = array_length(mesh->faces);
+    int num_vertices = array_length(mesh->vertices);
+    int num_clusters = array_length(mesh->clusters);
+
+    // (Re)allocate the per-frame selections only when the mesh changes size
+    if (array_length(mesh->visible_faces) != num_faces)
+    {
+        array_free(mesh->visible_faces);
+        mesh->visible_faces = array_hold(NULL, num_faces, sizeof(int));
+    }
+    if (array_length(mesh->visible_clusters) != num_clusters)
+    {
+        array_free(mesh->visible_clusters);
+        mesh->visible_clusters = array_hold(NULL, num_clusters, sizeof(visible_cluster_t));
+    }
+    if (array_length(mesh->is_vertex_visible) != num_vertices)
+    {
+        array_free(mesh->is_vertex_visible);
+        mesh->is_vertex_visible = array_hold(NULL, num_vertices, sizeof(uint8_t));
+    }
 
-    tex2_t *texcoords = NULL;
+    mesh->num_visible_faces = 0;
+    mesh->num_visible_clusters = 0;
+    memset(mesh->is_vertex_visible, 0, num_vertices);
 
-    while (fgets(line, 1024, file))
+    vec3_t camera = mesh_world_to_model(mesh, camera_position);
+    vec3_t scale = mesh->transform.scale;
+    float facing = scale.x * scale.y * scale.z < 0 ? -1 : 1;
+    float max_scale = fmaxf(fabsf(scale.x), fmaxf(fabsf(scale.y), fabsf(scale.z)));
+
+    for (int c = 0; c < num_clusters; c++)
     {
-        if (strncmp(line, "v ", 2) == 0)
+        cluster_t *cluster = &mesh->clusters[c];
+
+        // Clusters of a mesh completely inside or outside the frustum don't need their own test
+        frustum_test_t visibility = mesh_visibility;
+        if (visibility == FRUSTUM_INTERSECTING)
+        {
+            vec3_t center = vec3_from_vec4(mat4_mul_vec4(mesh->transform.model_view_matrix, vec4_from_vec3(cluster->center)));
+            visibility = frustum_test_sphere(projection_matrix, center, cluster->radius * max_scale);
+        }
+        if (visibility == FRUSTUM_OUTSIDE)
+            continue;
+
+        // Every face of the cluster points away when the camera looks along the cone axis by more than
+        // the cone spreads, with the margin widened by the sphere so it holds for all of its points
+        if (is_culling_enabled && cluster->cone_cutoff < 1)
         {
-            vec3_t vertex;
-            sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-            array_push(mesh.vertices, vertex);
+            vec3_t camera_to_center = vec3_sub(cluster->center, camera);
+            float distance = vec3_length(camera_to_center);
+            float alignment = facing * vec3_dot(cluster->cone_axis, camera_to_center);
+            if (alignment > cluster->cone_cutoff * distance + cluster->radius * (1 + cluster->cone_cutoff))
+                continue;
         }
 
-        if (strncmp(line, "vt ", 3) == 0)
+        visible_cluster_t visible_cluster = {
+            .first_visible_face = mesh->num_visible_faces,
+            .num_visible_faces = 0,
+            .visibility = visibility,
+        };
+
+        for (int i = cluster->first_face; i < cluster->first_face + cluster->num_faces; i++)
         {
-            tex2_t texcoord;
-            sscanf(line, "vt %f %f", &texcoord.u, &texcoord.v);
-            array_push(texcoords, texcoord);
+            face_t face = mesh->faces[i];
+
+            // Cull faces whose front side points away from the camera
+            if (is_culling_enabled)
+            {
+                vec3_t camera_ray = vec3_sub(camera, mesh->vertices[face.a]);
+                if (facing * vec3_dot(mesh->face_normals[i], camera_ray) < 0)
+                    continue;
+            }
+
+            mesh->visible_faces[mesh->num_visible_faces++] = i;
+            mesh->is_vertex_visible[face.a] = 1;
+            mesh->is_vertex_visible[face.b] = 1;
+            mesh->is_vertex_visible[face.c] = 1;
         }
 
-        if (strncmp(line, "f ", 2) == 0)
+        visible_cluster.num_visible_faces = mesh->num_visible_faces - visible_cluster.first_visible_face;
+        if (visible_cluster.num_visible_faces > 0)
+            mesh->visible_clusters[mesh->num_visible_clusters++] = visible_cluster;
+    }
+}
+
+// Normal of a face in camera space, for shading
+vec3_t mesh_face_view_normal(mesh_t *mesh, int face_index)
+{
+    // Normals go through the inverse transpose of the model-view matrix. With the
+    // 3x3 part being V * R * S that is V * R * S^-1, so divide by scale twice first
+    vec3_t n = mesh->face_normals[face_index];
+    vec3_t scale = mesh->transform.scale;
+    vec4_t normal = {n.x / (scale.x * scale.x), n.y / (scale.y * scale.y), n.z / (scale.z * scale.z), 0};
+
+    return vec3_normalized_or_zero(vec3_from_vec4(mat4_mul_vec4(mesh->transform.model_view_matrix, normal)));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Tests the bounds of the mesh against the view frustum of the current camera
+///////////////////////////////////////////////////////////////////////////////
+// The sphere is cheap and settles most meshes, only ones it finds crossing a
+// plane are tested again with the tighter box. Needs mesh_update_transform.
+///////////////////////////////////////////////////////////////////////////////
+frustum_test_t mesh_test_frustum(mesh_t *mesh, mat4_t projection_matrix)
+{
+    bounds_t *bounds = &mesh->bounds;
+    mat4_t model_view_matrix = mesh->transform.model_view_matrix;
+
+    // Rotations and the view matrix keep lengths, only the largest scale grows the sphere
+    float scale = fmaxf(fabsf(mesh->scale.x), fmaxf(fabsf(mesh->scale.y), fabsf(mesh->scale.z)));
+    vec3_t center = vec3_from_vec4(mat4_mul_vec4(model_view_matrix, vec4_from_vec3(bounds->center)));
+
+    frustum_test_t result = frustum_test_sphere(projection_matrix, center, bounds->radius * scale);
+    if (result != FRUSTUM_INTERSECTING)
+        return result;
+
+    mat4_t model_view_projection_matrix = mat4_mul_mat4(projection_matrix, model_view_matrix);
+    return frustum_test_box(model_view_projection_matrix, bounds->min, bounds->max);
+}
+
+void mesh_transform_vertices(mesh_t *mesh, mat4_t projection_matrix)
+{
+    int num_vertices = array_length(mesh->vertices);
+
+    // (Re)allocate the post-transform buffers only when the vertex count changes
+    if (array_length(mesh->view_vertices) != num_vertices)
+    {
+        array_free(mesh->view_vertices);
+        array_free(mesh->clip_vertices);
+        mesh->view_vertices = array_hold(NULL, num_vertices, sizeof(vec4_t));
+        mesh->clip_vertices = array_hold(NULL, num_vertices, sizeof(vec4_t));
+    }
+
+    // Transform every unique vertex a visible face uses once, faces then index into these buffers.
+    // Without a selection from mesh_select_visible_faces every vertex is transformed.
+    const uint8_t *is_vertex_visible = mesh->is_vertex_visible;
+    vertex_streams_t *streams = &mesh->vertex_streams;
+    if (streams->count == num_vertices)
+    {
+        mat4_t model_view_projection_matrix = mat4_mul_mat4(projection_matrix, mesh->transform.model_view_matrix);
+
+        // Batch the visible vertices in runs of consecutive indices
+        int run_start = 0;
+        while (run_start < num_vertices)
         {
-            int vertex_indicies[3];
-            int texture_indicies[3];
-            int normal_indicies[3];
-
-            sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                   &vertex_indicies[0], &texture_indicies[0], &normal_indicies[0],
-                   &vertex_indicies[1], &texture_indicies[1], &normal_indicies[1],
-                   &vertex_indicies[2], &texture_indicies[2], &normal_indicies[2]);
-
-            face_t face = {
-                .a = vertex_indicies[0] - 1,
-                .b = vertex_indicies[1] - 1,
-                .c = vertex_indicies[2] - 1,
-                .a_uv = texcoords[texture_indicies[0] - 1],
-                .b_uv = texcoords[texture_indicies[1] - 1],
-                .c_uv = texcoords[texture_indicies[2] - 1],
-                .color = 0xFFFFFFFF,
-            };
-
-            array_push(mesh.faces, face);
+            if (is_vertex_visible != NULL && !is_vertex_visible[run_start])
+            {
+                run_start++;
+                continue;
+            }
+
+            int run_end = run_start + 1;
+            while (run_end < num_vertices && (is_vertex_visible == NULL || is_vertex_visible[run_end]))
+                run_end++;
+
+            int count = run_end - run_start;
+            mat4_transform_points(mesh->transform.model_view_matrix, streams->x + run_start, streams->y + run_start, streams->z + run_start, mesh->view_vertices + run_start, count);
+            mat4_transform_points(model_view_projection_matrix, streams->x + run_start, streams->y + run_start, streams->z + run_start, mesh->clip_vertices + run_start, count);
+            run_start = run_end;
         }
+        return;
+    }
+
+    for (int i = 0; i < num_vertices; i++)
+    {
+        if (is_vertex_visible != NULL && !is_vertex_visible[i])
+            continue;
+
+        vec4_t view_vertex = mat4_mul_vec4(mesh->transform.model_view_matrix, vec4_from_vec3(mesh->vertices[i]));
+        mesh->view_vertices[i] = view_vertex;
+        mesh->clip_vertices[i] = mat4_mul_vec4(projection_matrix, view_vertex);
     }
+}
 
-    array_free(texcoords);
+void mesh_free(mesh_t *mesh)
+{
+    // Arrays pointing into a cache go away with its mapping
+    if (mesh->cache.data != NULL)
+    {
+        unmap_file(&mesh->cache);
+    }
+    else
+    {
+        array_free(mesh->vertices);
+        array_free(mesh->texcoords);
+        array_free(mesh->faces);
+        array_free(mesh->face_normals);
+        array_free(mesh->clusters);
+        free(mesh->vertex_streams.memory);
+    }
+    array_free(mesh->view_vertices);
+    array_free(mesh->clip_vertices);
+    array_free(mesh->visible_faces);
+    array_free(mesh->visible_clusters);
+    array_free(mesh->is_vertex_visible);
+    mesh->vertex_streams = (vertex_streams_t){NULL, NULL, NULL, 0, NULL};
+    mesh->vertices = NULL;
+    mesh->texcoords = NULL;
+    mesh->faces = NULL;
+    mesh->view_vertices = NULL;
+    mesh->clip_vertices = NULL;
+    mesh->face_normals = NULL;
+    mesh->clusters = NULL;
+    mesh->visible_faces = NULL;
+    mesh->num_visible_faces = 0;
+    mesh->visible_clusters = NULL;
+    mesh->num_visible_clusters = 0;
+    mesh->is_vertex_visible = NULL;
 }
@@ -1,27 +1,116 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "vector.h"
+#include "matrix.h"
 #include "triangle.h"
+#include "clipping.h"
+#include "obj.h"
+#include "file.h"
 
 #define N_CUBE_VERTICES 8
+#define N_CUBE_TEXCOORDS 4
 #define N_CUBE_FACES (6 * 2) // 6 faces of a cube, 2 triangles each
 
+// Most faces grouped into one cluster
+#define MESH_CLUSTER_MAX_FACES 128
+
 extern vec3_t cube_vertices[N_CUBE_VERTICES];
-extern face_t cube_faces[N_CUBE_FACES];
+extern tex2_t cube_texcoords[N_CUBE_TEXCOORDS];
+extern face_corner_t cube_faces[N_CUBE_FACES][3];
+
+// Cached matrices of a mesh, rebuilt only when their inputs change
+typedef struct
+{
+    mat4_t world_matrix;      // scale, rotation and translation composed
+    mat4_t model_view_matrix; // view_matrix * world_matrix
+    vec3_t rotation;          // Inputs the cached matrices were built from
+    vec3_t scale;
+    vec3_t translation;
+    mat4_t view_matrix;
+    bool is_world_dirty;
+    bool is_model_view_dirty;
+} transform_t;
+
+// Structure-of-arrays copy of the mesh vertices for the batched transform
+typedef struct
+{
+    float *x;
+    float *y;
+    float *z;
+    int count;
+    void *memory; // Unaligned allocation backing the three streams
+} vertex_streams_t;
+
+// Bounding volumes of the mesh vertices in model space
+typedef struct
+{
+    vec3_t min; // Axis aligned bounding box
+    vec3_t max;
+    vec3_t center; // Bounding sphere
+    float radius;
+} bounds_t;
+
+// Patch of neighbouring faces culled as a whole, mesh faces first_face .. first_face + num_faces - 1
+typedef struct
+{
+    int first_face;
+    int num_faces;
+    vec3_t center; // Bounding sphere in model space
+    float radius;
+    vec3_t cone_axis;  // Average direction of the face normals
+    float cone_cutoff; // Sine of the largest angle between a normal and the axis, 1 when it spans a half-space or more
+} cluster_t;
+
+// Part of a cluster that survived culling this frame
+typedef struct
+{
+    int first_visible_face; // Index into mesh visible_faces
+    int num_visible_faces;
+    frustum_test_t visibility; // Whether the faces may need clipping
+} visible_cluster_t;
 
 typedef struct
 {
     vec3_t *vertices;
+    tex2_t *texcoords; // Texture coordinate of every vertex
     face_t *faces;
     vec3_t rotation;
     vec3_t scale;
     vec3_t translation;
+    vertex_streams_t vertex_streams; // Optional, built by mesh_build_vertex_streams
+    bounds_t bounds;                 // Built by mesh_compute_bounds
+    vec3_t *face_normals;            // Unit normal of every face in model space, built by mesh_compute_face_normals
+    cluster_t *clusters;             // Neighbouring faces in contiguous ranges that cover the faces, built by mesh_build_clusters
+    int *visible_faces;              // Indices of the faces that passed culling this frame, grouped by cluster
+    int num_visible_faces;
+    visible_cluster_t *visible_clusters;
+    int num_visible_clusters;
+    uint8_t *is_vertex_visible; // Per vertex, set when a visible face uses it
+    transform_t transform;
+    vec4_t *view_vertices; // Post-transform vertex buffer in camera space
+    vec4_t *clip_vertices; // Post-transform vertex buffer in clip space
+    mapped_file_t cache;   // Set when the arrays built at load time point into a mapped cache file
 } mesh_t;
 
 extern mesh_t mesh;
 
 void load_cube_mesh_data();
 void load_obj_file_data(char *filename);
+void mesh_build_vertex_streams(mesh_t *mesh);
+void mesh_compute_bounds(mesh_t *mesh);
+void mesh_compute_face_normals(mesh_t *mesh);
+void mesh_build_clusters(mesh_t *mesh);
+void mesh_optimize_vertex_cache(mesh_t *mesh);
+void mesh_optimize_vertex_fetch(mesh_t *mesh);
+void mesh_update_transform(mesh_t *mesh, mat4_t view_matrix);
+void mesh_select_visible_faces(mesh_t *mesh, vec3_t camera_position, mat4_t projection_matrix,
+                               frustum_test_t mesh_visibility, bool is_culling_enabled);
+vec3_t mesh_face_view_normal(mesh_t *mesh, int face_index);
+frustum_test_t mesh_test_frustum(mesh_t *mesh, mat4_t projection_matrix);
+void mesh_transform_vertices(mesh_t *mesh, mat4_t projection_matrix);
+void mesh_free(mesh_t *mesh);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "mesh_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "array.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Binary mesh cache
+///////////////////////////////////////////////////////////////////////////////
+// Everything mesh_finish_loading builds from a source file, stored the way it
+// sits in memory: a header, then one section per mesh array. Each section is
+// preceded by the bookkeeping array.h keeps in front of its items, so the
+// mesh arrays point straight into the mapped file and nothing is parsed,
+// copied or rebuilt. The header records the size and hash of the source file
+// the cache was built from and the size of every stored structure, a cache
+// that doesn't match any of them is ignored and rebuilt.
+//
+// The file is in the byte order and structure layout of the machine that
+// wrote it, the sizes in the header catch the layouts that differ.
+///////////////////////////////////////////////////////////////////////////////
+
+#define MESH_CACHE_MAGIC "MESHBIN"
+
+// Every section starts on a cache line, which also keeps the vertex streams SIMD aligned
+#define MESH_CACHE_ALIGNMENT 64
+
+enum
+{
+    CACHE_VERTICES,
+    CACHE_TEXCOORDS,
+    CACHE_FACES,
+    CACHE_FACE_NORMALS,
+    CACHE_CLUSTERS,
+    CACHE_VERTEX_STREAMS, // x, y and z streams back to back, each padded like mesh_build_vertex_streams does
+    NUM_CACHE_SECTIONS
+};
+
+typedef struct
+{
+    uint64_t offset; // Of the first item from the start of the file
+    int32_t count;
+    int32_t item_size;
+} mesh_cache_section_t;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_size;
+    uint64_t source_hash;
+    bounds_t bounds;
+    mesh_cache_section_t sections[NUM_CACHE_SECTIONS];
+} mesh_cache_header_t;
+
+// Vertex streams are padded to a whole number of 8-float registers
+static int vertex_stream_stride(int num_vertices)
+{
+    return (num_vertices + 7) & ~7;
+}
+
+// Item counts and sizes the sections of a mesh with these many elements have
+static void describe_sections(mesh_cache_section_t *sections, int num_vertices, int num_faces, int num_clusters)
+{
+    sections[CACHE_VERTICES] = (mesh_cache_section_t){0, num_vertices, sizeof(vec3_t)};
+    sections[CACHE_TEXCOORDS] = (mesh_cache_section_t){0, num_vertices, sizeof(tex2_t)};
+    sections[CACHE_FACES] = (mesh_cache_section_t){0, num_faces, sizeof(face_t)};
+    sections[CACHE_FACE_NORMALS] = (mesh_cache_section_t){0, num_faces, sizeof(vec3_t)};
+    sections[CACHE_CLUSTERS] = (mesh_cache_section_t){0, num_clusters, sizeof(cluster_t)};
+    sections[CACHE_VERTEX_STREAMS] = (mesh_cache_section_t){0, 3 * vertex_stream_stride(num_vertices), sizeof(float)};
+}
+
+// Places the sections one after the other, returns the size of the whole file
+static uint64_t layout_sections(mesh_cache_section_t *sections)
+{
+    uint64_t end = sizeof(mesh_cache_header_t);
+    for (int s = 0; s < NUM_CACHE_SECTIONS; s++)
+    {
+        uint64_t offset = end + ARRAY_HEADER_SIZE;
+        offset = (offset + MESH_CACHE_ALIGNMENT - 1) & ~(uint64_t)(MESH_CACHE_ALIGNMENT - 1);
+        sections[s].offset = offset;
+        end = offset + (uint64_t)sections[s].count * sections[s].item_size;
+    }
+    return end;
+}
+
+// Whether every face only uses existing vertices and the clusters cut the faces into consecutive runs,
+// like mesh_build_clusters does. The mesh is drawn straight from the file, a damaged one must not index past it.
+static bool are_indices_valid(const face_t *faces, int num_faces, int num_vertices, const cluster_t *clusters, int num_clusters)
+{
+    for (int i = 0; i < num_faces; i++)
+    {
+        face_t face = faces[i];
+        if (face.a < 0 || face.a >= num_vertices ||
+            face.b < 0 || face.b >= num_vertices ||
+            face.c < 0 || face.c >= num_vertices)
+            return false;
+    }
+
+    int next_face = 0;
+    for (int c = 0; c < num_clusters; c++)
+    {
+        if (clusters[c].first_face != next_face || clusters[c].num_faces <= 0 || clusters[c].num_faces > num_faces - next_face)
+            return false;
+        next_face += clusters[c].num_faces;
+    }
+
+    return next_face == num_faces;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps a cache file into the mesh, false when it is missing or stale
+///////////////////////////////////////////////////////////////////////////////
+// The mesh arrays stay valid until mesh_free unmaps the file, they are read
+// only and must never be pushed to or freed on their own. Face indices and
+// cluster ranges are checked once here, so a damaged file is rebuilt rather
+// than read out of bounds.
+///////////////////////////////////////////////////////////////////////////////
+bool mesh_cache_load(mesh_t *mesh, const char *filename, uint64_t source_size, uint64_t source_hash)
+{
+    mapped_file_t file;
+    if (!map_file(filename, &file))
+        return false;
+
+    mesh_cache_header_t header;
+    if (file.size < sizeof(header))
+    {
+        unmap_file(&file);
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+
+    bool is_valid = memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+                    header.version == MESH_CACHE_VERSION &&
+                    header.header_size == sizeof(header) &&
+                    header.source_size == source_size &&
+                    header.source_hash == source_hash;
+
+    // The sections must be exactly where a writer of this version puts them
+    for (int s = 0; s < NUM_CACHE_SECTIONS; s++)
+        is_valid = is_valid && header.sections[s].count >= 0;
+
+    mesh_cache_section_t expected[NUM_CACHE_SECTIONS];
+    describe_sections(expected, header.sections[CACHE_VERTICES].count, header.sections[CACHE_FACES].count, header.sections[CACHE_CLUSTERS].count);
+    is_valid = is_valid && layout_sections(expected) <= file.size;
+    for (int s = 0; s < NUM_CACHE_SECTIONS && is_valid; s++)
+    {
+        is_valid = expected[s].offset == header.sections[s].offset &&
+                   expected[s].count == header.sections[s].count &&
+                   expected[s].item_size == header.sections[s].item_size;
+    }
+
+    char *data = (char *)file.data;
+    is_valid = is_valid && are_indices_valid((const face_t *)(data + header.sections[CACHE_FACES].offset),
+                                             header.sections[CACHE_FACES].count,
+                                             header.sections[CACHE_VERTICES].count,
+                                             (const cluster_t *)(data + header.sections[CACHE_CLUSTERS].offset),
+                                             header.sections[CACHE_CLUSTERS].count);
+
+    if (!is_valid)
+    {
+        unmap_file(&file);
+        return false;
+    }
+
+    mesh->vertices = (vec3_t *)(data + header.sections[CACHE_VERTICES].offset);
+    mesh->texcoords = (tex2_t *)(data + header.sections[CACHE_TEXCOORDS].offset);
+    mesh->faces = (face_t *)(data + header.sections[CACHE_FACES].offset);
+    mesh->face_normals = (vec3_t *)(data + header.sections[CACHE_FACE_NORMALS].offset);
+    mesh->clusters = (cluster_t *)(data + header.sections[CACHE_CLUSTERS].offset);
+
+    int num_vertices = header.sections[CACHE_VERTICES].count;
+    int stride = vertex_stream_stride(num_vertices);
+    float *streams = (float *)(data + header.sections[CACHE_VERTEX_STREAMS].offset);
+    mesh->vertex_streams = (vertex_streams_t){streams, streams + stride, streams + 2 * stride, num_vertices, NULL};
+
+    mesh->bounds = header.bounds;
+    mesh->cache = file;
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writes the loaded mesh as a cache of the source file with this size and hash
+///////////////////////////////////////////////////////////////////////////////
+// The file is built in memory and written under a temporary name first, so a
+// crash while writing never leaves a truncated cache behind.
+///////////////////////////////////////////////////////////////////////////////
+bool mesh_cache_write(const mesh_t *mesh, const char *filename, uint64_t source_size, uint64_t source_hash)
+{
+    mesh_cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.header_size = sizeof(header);
+    header.source_size = source_size;
+    header.source_hash = source_hash;
+    header.bounds = mesh->bounds;
+
+    int num_vertices = array_length(mesh->vertices);
+    describe_sections(header.sections, num_vertices, array_length(mesh->faces), array_length(mesh->clusters));
+    uint64_t size = layout_sections(header.sections);
+
+    const void *items[NUM_CACHE_SECTIONS] = {
+        [CACHE_VERTICES] = mesh->vertices,
+        [CACHE_TEXCOORDS] = mesh->texcoords,
+        [CACHE_FACES] = mesh->faces,
+        [CACHE_FACE_NORMALS] = mesh->face_normals,
+        [CACHE_CLUSTERS] = mesh->clusters,
+    };
+
+    // Zeroed so the alignment gaps are written the same every time
+    char *image = calloc(size, 1);
+    memcpy(image, &header, sizeof(header));
+    for (int s = 0; s < NUM_CACHE_SECTIONS; s++)
+    {
+        mesh_cache_section_t section = header.sections[s];
+        array_init_header(image + section.offset - ARRAY_HEADER_SIZE, section.count);
+        if (section.count > 0 && s != CACHE_VERTEX_STREAMS)
+            memcpy(image + section.offset, items[s], (size_t)section.count * section.item_size);
+    }
+
+    // Only the vertices of each stream, the padding after them is left uninitialized in memory
+    int stride = vertex_stream_stride(num_vertices);
+    float *streams = (float *)(image + header.sections[CACHE_VERTEX_STREAMS].offset);
+    if (num_vertices > 0)
+    {
+        memcpy(streams, mesh->vertex_streams.x, sizeof(float) * num_vertices);
+        memcpy(streams + stride, mesh->vertex_streams.y, sizeof(float) * num_vertices);
+        memcpy(streams + 2 * stride, mesh->vertex_streams.z, sizeof(float) * num_vertices);
+    }
+
+    char temporary_name[1024];
+    snprintf(temporary_name, sizeof(temporary_name), "%s.tmp", filename);
+
+    FILE *file = fopen(temporary_name, "wb");
+    bool is_written = file != NULL && fwrite(image, 1, size, file) == size;
+    if (file != NULL)
+        is_written = fclose(file) == 0 && is_written;
+    free(image);
+
+    // rename won't replace an existing file everywhere
+    remove(filename);
+    if (!is_written || rename(temporary_name, filename) != 0)
+    {
+        remove(temporary_name);
+        fprintf(stderr, "Error writing mesh cache %s.\n", filename);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,14 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mesh.h"
+
+// Bump whenever the layout of the file or of the structures it stores changes
+#define MESH_CACHE_VERSION 2
+
+bool mesh_cache_load(mesh_t *mesh, const char *filename, uint64_t source_size, uint64_t source_hash);
+bool mesh_cache_write(const mesh_t *mesh, const char *filename, uint64_t source_size, uint64_t source_hash);
+
+#endif
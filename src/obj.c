@@ -0,0 +1,442 @@
+#include "obj.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include "array.h"
+#include "file.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Tokenizer
+///////////////////////////////////////////////////////////////////////////////
+// Every function takes the position to read from and the end of the buffer,
+// never reads past the end and leaves the position after what it consumed.
+// The file is not null terminated, so nothing here may lean on strtod or
+// sscanf stopping at a terminator.
+///////////////////////////////////////////////////////////////////////////////
+
+static bool is_blank(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static const char *skip_blanks(const char *p, const char *end)
+{
+    while (p < end && is_blank(*p))
+        p++;
+    return p;
+}
+
+static const char *skip_line(const char *p, const char *end)
+{
+    // Lines usually end right where parsing stopped
+    if (p < end && *p == '\n')
+        return p + 1;
+
+    const char *newline = memchr(p, '\n', end - p);
+    return newline ? newline + 1 : end;
+}
+
+static const char *parse_int(const char *p, const char *end, int *value)
+{
+    p = skip_blanks(p, end);
+
+    bool is_negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        is_negative = *p++ == '-';
+
+    int result = 0;
+    while (p < end && is_digit(*p))
+        result = result * 10 + (*p++ - '0');
+
+    *value = is_negative ? -result : result;
+    return p;
+}
+
+// Powers of ten a double holds exactly
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+#define MAX_EXACT_POWER_OF_TEN 22
+
+// Up to 19 significant digits fit an uint64_t, later ones only shift the exponent
+#define MAX_MANTISSA_DIGITS 19
+
+// Scales the mantissa by the power of ten and applies the sign
+static float float_from_decimal(uint64_t mantissa, int exponent, bool is_negative)
+{
+    double result = (double)mantissa;
+    if (exponent < 0 && exponent >= -MAX_EXACT_POWER_OF_TEN)
+        result /= exact_powers_of_ten[-exponent];
+    else if (exponent > 0 && exponent <= MAX_EXACT_POWER_OF_TEN)
+        result *= exact_powers_of_ten[exponent];
+    else if (exponent != 0)
+        result *= pow(10, exponent);
+
+    return (float)(is_negative ? -result : result);
+}
+
+// Digits of a number too long for the fast path, from the first digit on
+static const char *parse_long_float(const char *p, const char *end, uint64_t *mantissa, int *exponent)
+{
+    int num_digits = 0;
+    *mantissa = 0;
+    *exponent = 0;
+
+    bool is_fraction = false;
+    for (; p < end && (is_digit(*p) || (*p == '.' && !is_fraction)); p++)
+    {
+        if (*p == '.')
+        {
+            is_fraction = true;
+        }
+        else if (num_digits < MAX_MANTISSA_DIGITS)
+        {
+            *mantissa = *mantissa * 10 + (*p - '0');
+            if (*mantissa > 0)
+                num_digits++;
+            if (is_fraction)
+                (*exponent)--;
+        }
+        else if (!is_fraction)
+        {
+            (*exponent)++;
+        }
+    }
+
+    return p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Decimal floating point number, as in 1, -0.25, .5 or 1.5e-3
+///////////////////////////////////////////////////////////////////////////////
+// The digits are gathered into an integer mantissa and a power of ten. With
+// fewer than 2^53 in the mantissa and an exponent a double holds exactly, one
+// multiplication or division rounds once, and the rounding down to float
+// gives what strtof gives for the numbers exporters write. Numbers of up to
+// 19 digits, which is all of them in practice, can't overflow the mantissa
+// and take a loop without any checks per digit.
+///////////////////////////////////////////////////////////////////////////////
+static const char *parse_float(const char *p, const char *end, float *value)
+{
+    p = skip_blanks(p, end);
+
+    bool is_negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        is_negative = *p++ == '-';
+
+    const char *first_digit = p;
+    uint64_t mantissa = 0;
+    int exponent = 0;
+
+    while (p < end && is_digit(*p))
+        mantissa = mantissa * 10 + (*p++ - '0');
+    int num_digits = p - first_digit;
+
+    if (p < end && *p == '.')
+    {
+        const char *first_fraction_digit = ++p;
+        while (p < end && is_digit(*p))
+            mantissa = mantissa * 10 + (*p++ - '0');
+        exponent = first_fraction_digit - p;
+        num_digits -= exponent;
+    }
+
+    if (num_digits > MAX_MANTISSA_DIGITS)
+        parse_long_float(first_digit, end, &mantissa, &exponent);
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int written_exponent;
+        p = parse_int(p + 1, end, &written_exponent);
+        exponent += written_exponent;
+    }
+
+    *value = float_from_decimal(mantissa, exponent, is_negative);
+    return p;
+}
+
+// OBJ indices count from 1, negative ones count back from the last element read so far
+static int resolve_index(int index, int num_read)
+{
+    return index < 0 ? num_read + index + 1 : index;
+}
+
+// One corner of a face: position, position/texcoord, position//normal or position/texcoord/normal
+static const char *parse_face_corner(const char *p, const char *end, int num_positions, int num_texcoords, face_corner_t *corner)
+{
+    int texcoord = 0;
+    int position;
+    p = parse_int(p, end, &position);
+
+    if (p < end && *p == '/')
+    {
+        p++;
+        if (p < end && *p != '/')
+            p = parse_int(p, end, &texcoord);
+
+        // Normals are not used, faces are lit by their own normal
+        if (p < end && *p == '/')
+        {
+            int normal;
+            p = parse_int(p + 1, end, &normal);
+        }
+    }
+
+    corner->position = resolve_index(position, num_positions);
+    corner->texcoord = resolve_index(texcoord, num_texcoords);
+    return p;
+}
+
+// Whether all corners of a face use positions and texture coordinates the file has
+static bool is_face_valid(const face_corner_t *face, int num_positions, int num_texcoords)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        if (face[k].position < 1 || face[k].position > num_positions ||
+            face[k].texcoord < 0 || face[k].texcoord > num_texcoords)
+            return false;
+    }
+    return true;
+}
+
+// Whether the line at p starts with the keyword followed by a blank
+static bool is_keyword(const char *p, const char *end, const char *keyword, int length)
+{
+    return end - p > length && memcmp(p, keyword, length) == 0 && is_blank(p[length]);
+}
+
+// Lines begin .. end - 1 of the file, counted and parsed by one thread
+typedef struct
+{
+    const char *begin;
+    const char *end;
+    int num_positions; // Elements in the chunk, set by count_chunk
+    int num_texcoords;
+    int num_faces;      // Set again by parse_chunk to the faces it kept
+    int first_position; // Elements in all chunks before this one
+    int first_texcoord;
+    int first_face;
+    obj_data_t *obj; // Shared by all chunks, each one fills its own range
+} obj_chunk_t;
+
+// First pass, the statements are recognized by their first bytes only
+static int count_chunk(void *chunk_pointer)
+{
+    obj_chunk_t *chunk = chunk_pointer;
+    const char *p = chunk->begin;
+    const char *end = chunk->end;
+
+    while (p < end)
+    {
+        p = skip_blanks(p, end);
+
+        if (is_keyword(p, end, "v", 1))
+            chunk->num_positions++;
+        else if (is_keyword(p, end, "vt", 2))
+            chunk->num_texcoords++;
+        else if (is_keyword(p, end, "f", 1))
+            chunk->num_faces++;
+
+        p = skip_line(p, end);
+    }
+
+    return 0;
+}
+
+// Second pass, recognizes the lines count_chunk counted and reads them with the tokenizer above
+static int parse_chunk(void *chunk_pointer)
+{
+    obj_chunk_t *chunk = chunk_pointer;
+    vec3_t *positions = chunk->obj->positions + chunk->first_position;
+    tex2_t *texcoords = chunk->obj->texcoords + chunk->first_texcoord;
+    face_corner_t *corners = chunk->obj->corners + 3 * chunk->first_face;
+    int num_positions = 0;
+    int num_texcoords = 0;
+    int num_faces = 0;
+
+    // Faces are checked against the elements of the whole file
+    int num_file_positions = array_length(chunk->obj->positions);
+    int num_file_texcoords = array_length(chunk->obj->texcoords);
+
+    const char *p = chunk->begin;
+    const char *end = chunk->end;
+
+    while (p < end)
+    {
+        p = skip_blanks(p, end);
+
+        if (is_keyword(p, end, "v", 1))
+        {
+            vec3_t *position = &positions[num_positions++];
+            p = parse_float(p + 1, end, &position->x);
+            p = parse_float(p, end, &position->y);
+            p = parse_float(p, end, &position->z);
+        }
+        else if (is_keyword(p, end, "vt", 2))
+        {
+            tex2_t *texcoord = &texcoords[num_texcoords++];
+            p = parse_float(p + 2, end, &texcoord->u);
+            p = parse_float(p, end, &texcoord->v);
+        }
+        else if (is_keyword(p, end, "f", 1))
+        {
+            // The counts of the chunks before this one make relative indices absolute
+            face_corner_t *face = &corners[3 * num_faces];
+            p++;
+            for (int k = 0; k < 3; k++)
+            {
+                p = parse_face_corner(p, end, chunk->first_position + num_positions, chunk->first_texcoord + num_texcoords,
+                                      &face[k]);
+            }
+
+            // A face indexing past the file is skipped, the next one takes its place
+            if (is_face_valid(face, num_file_positions, num_file_texcoords))
+                num_faces++;
+        }
+
+        p = skip_line(p, end);
+    }
+
+    chunk->num_faces = num_faces;
+    return 0;
+}
+
+// Runs fn on every chunk, the calling thread takes the first one while the others run
+static void run_chunks(SDL_ThreadFunction fn, obj_chunk_t *chunks, int num_chunks)
+{
+    SDL_Thread **threads = malloc(sizeof(SDL_Thread *) * num_chunks);
+    for (int i = 1; i < num_chunks; i++)
+    {
+        threads[i] = SDL_CreateThread(fn, "obj_parser", &chunks[i]);
+
+        // Every chunk must be read, one that didn't get a thread is read right here
+        if (threads[i] == NULL)
+            fn(&chunks[i]);
+    }
+    fn(&chunks[0]);
+    for (int i = 1; i < num_chunks; i++)
+    {
+        if (threads[i] != NULL)
+            SDL_WaitThread(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Files are split in chunks of at least this many bytes, one per core at most
+#define OBJ_MIN_CHUNK_SIZE (256 * 1024)
+
+///////////////////////////////////////////////////////////////////////////////
+// Reads the positions, texture coordinates and triangles of an OBJ file
+///////////////////////////////////////////////////////////////////////////////
+// The mapped file is cut into one chunk per core at line boundaries and read
+// in two passes over all chunks in parallel. The first only counts the
+// statements, a prefix sum over the counts then gives every chunk its range
+// of the output arrays, which are allocated once at their exact size. The
+// second parses each chunk straight into its range. Only the first three
+// corners of a face are kept and other statements are skipped. Returns
+// false when the file can't be opened, obj is left empty then.
+///////////////////////////////////////////////////////////////////////////////
+bool obj_parse_file(const char *filename, obj_data_t *obj)
+{
+    obj->positions = NULL;
+    obj->texcoords = NULL;
+    obj->corners = NULL;
+
+    Uint64 start_time = SDL_GetPerformanceCounter();
+
+    mapped_file_t file;
+    if (!map_file(filename, &file))
+    {
+        fprintf(stderr, "Error opening %s.\n", filename);
+        return false;
+    }
+
+    int num_chunks = SDL_GetCPUCount();
+    if (num_chunks > (int)(file.size / OBJ_MIN_CHUNK_SIZE))
+        num_chunks = file.size / OBJ_MIN_CHUNK_SIZE;
+    if (num_chunks < 1)
+        num_chunks = 1;
+
+    obj_chunk_t *chunks = calloc(num_chunks, sizeof(obj_chunk_t));
+    const char *end = file.data + file.size;
+    for (int i = 0; i < num_chunks; i++)
+    {
+        // Every chunk but the first starts after the line its even share of the file begins in
+        const char *begin = file.data + file.size / num_chunks * i;
+        if (i > 0)
+            begin = skip_line(begin - 1, end);
+
+        chunks[i].begin = begin;
+        chunks[i].obj = obj;
+        if (i > 0)
+            chunks[i - 1].end = begin;
+    }
+    chunks[num_chunks - 1].end = end;
+
+    run_chunks(count_chunk, chunks, num_chunks);
+
+    int num_positions = 0;
+    int num_texcoords = 0;
+    int num_faces = 0;
+    for (int i = 0; i < num_chunks; i++)
+    {
+        chunks[i].first_position = num_positions;
+        chunks[i].first_texcoord = num_texcoords;
+        chunks[i].first_face = num_faces;
+        num_positions += chunks[i].num_positions;
+        num_texcoords += chunks[i].num_texcoords;
+        num_faces += chunks[i].num_faces;
+    }
+
+    obj->positions = num_positions > 0 ? array_hold(NULL, num_positions, sizeof(vec3_t)) : NULL;
+    obj->texcoords = num_texcoords > 0 ? array_hold(NULL, num_texcoords, sizeof(tex2_t)) : NULL;
+    obj->corners = num_faces > 0 ? array_hold(NULL, 3 * num_faces, sizeof(face_corner_t)) : NULL;
+
+    run_chunks(parse_chunk, chunks, num_chunks);
+
+    // Close the gaps skipped faces left at the end of the chunk ranges
+    int num_kept_faces = 0;
+    for (int i = 0; i < num_chunks; i++)
+    {
+        if (chunks[i].num_faces > 0 && chunks[i].first_face != num_kept_faces)
+        {
+            memmove(obj->corners + 3 * num_kept_faces, obj->corners + 3 * chunks[i].first_face,
+                    sizeof(face_corner_t) * 3 * chunks[i].num_faces);
+        }
+        num_kept_faces += chunks[i].num_faces;
+    }
+    free(chunks);
+
+    if (num_kept_faces < num_faces)
+    {
+        fprintf(stderr, "Skipped %d faces with invalid indices in %s.\n", num_faces - num_kept_faces, filename);
+        array_truncate(obj->corners, 3 * num_kept_faces);
+    }
+
+    double seconds = (SDL_GetPerformanceCounter() - start_time) / (double)SDL_GetPerformanceFrequency();
+    double megabytes = file.size / (1024.0 * 1024.0);
+    printf("Parsed %s: %.2f MB in %.2f ms on %d threads, %.0f MB/s\n",
+           filename, megabytes, seconds * 1000, num_chunks, seconds > 0 ? megabytes / seconds : 0);
+
+    unmap_file(&file);
+    return true;
+}
+
+void obj_free(obj_data_t *obj)
+{
+    array_free(obj->positions);
+    array_free(obj->texcoords);
+    array_free(obj->corners);
+    obj->positions = NULL;
+    obj->texcoords = NULL;
+    obj->corners = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include <stdbool.h>
+#include "vector.h"
+#include "texture.h"
+
+// Corner of a face as files store it, a position and a texture coordinate counting from 1 like OBJ files do
+typedef struct
+{
+    int position;
+    int texcoord;
+} face_corner_t;
+
+// Contents of an OBJ file, before its corners are welded into mesh vertices
+typedef struct
+{
+    vec3_t *positions;      // v lines
+    tex2_t *texcoords;      // vt lines
+    face_corner_t *corners; // Three per f line, texcoord 0 when the file has none
+} obj_data_t;
+
+bool obj_parse_file(const char *filename, obj_data_t *obj);
+void obj_free(obj_data_t *obj);
+
+#endif
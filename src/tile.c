@@ -0,0 +1,221 @@
+#include "tile.h"
+#include "display.h"
+#include "array.h"
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Tile-binned multithreaded rasterization
+///////////////////////////////////////////////////////////////////////////////
+// Items (triangles in draw order) are binned by their screen bounding box into
+// TILE_SIZE x TILE_SIZE tiles. Tiles are then rendered in parallel, each one by
+// a single thread with the clip rect set to the tile, so every thread owns its
+// part of color_buffer and z_buffer and no locking is needed. Items are drawn in
+// binning order inside each tile, which keeps the output identical to drawing
+// them all in sequence over the whole screen.
+///////////////////////////////////////////////////////////////////////////////
+
+// Range of tiles covered by one item, inclusive
+typedef struct
+{
+    uint16_t min_x;
+    uint16_t min_y;
+    uint16_t max_x;
+    uint16_t max_y;
+} tile_range_t;
+
+static arena_t tile_arena = {NULL, 0, 0, 0, NULL};
+static tile_range_t *item_ranges = NULL;
+
+// Items of tile t are tile_items[tile_offsets[t]] .. tile_items[tile_offsets[t + 1] - 1]
+static int *tile_offsets = NULL;
+static int *tile_items = NULL;
+
+static int num_tiles_x = 0;
+static int num_tiles_y = 0;
+
+static tile_draw_fn draw_item = NULL;
+static SDL_atomic_t next_tile;
+
+static SDL_Thread **workers = NULL;
+static int num_workers = 0;
+static SDL_sem *work_ready = NULL;
+static SDL_sem *work_done = NULL;
+static bool is_shutting_down = false;
+
+static void render_tiles(void)
+{
+    int num_tiles = num_tiles_x * num_tiles_y;
+
+    // Grab tiles until none are left, big tiles and empty tiles balance out across threads
+    for (int tile = SDL_AtomicAdd(&next_tile, 1); tile < num_tiles; tile = SDL_AtomicAdd(&next_tile, 1))
+    {
+        int first = tile_offsets[tile];
+        int last = tile_offsets[tile + 1];
+        if (first == last)
+            continue;
+
+        int min_x = (tile % num_tiles_x) * TILE_SIZE;
+        int min_y = (tile / num_tiles_x) * TILE_SIZE;
+        int max_x = min_x + TILE_SIZE < window_width ? min_x + TILE_SIZE : window_width;
+        int max_y = min_y + TILE_SIZE < window_height ? min_y + TILE_SIZE : window_height;
+        set_clip_rect(min_x, min_y, max_x, max_y);
+
+        for (int i = first; i < last; i++)
+        {
+            draw_item(tile_items[i]);
+        }
+    }
+}
+
+static int tile_worker(void *data)
+{
+    (void)data;
+
+    while (true)
+    {
+        SDL_SemWait(work_ready);
+        if (is_shutting_down)
+            break;
+
+        render_tiles();
+        SDL_SemPost(work_done);
+    }
+
+    return 0;
+}
+
+void tiles_init(void)
+{
+    // The main thread renders tiles too, so start one worker less than there are cores
+    num_workers = SDL_GetCPUCount() - 1;
+    if (num_workers < 0)
+        num_workers = 0;
+
+    work_ready = SDL_CreateSemaphore(0);
+    work_done = SDL_CreateSemaphore(0);
+    workers = (SDL_Thread **)malloc(sizeof(SDL_Thread *) * (num_workers > 0 ? num_workers : 1));
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i] = SDL_CreateThread(tile_worker, "tile_worker", NULL);
+
+        // Go on with the workers that started, the main thread takes the tiles they would have
+        if (workers[i] == NULL)
+        {
+            fprintf(stderr, "Error creating tile worker.\n");
+            num_workers = i;
+            break;
+        }
+    }
+}
+
+void tiles_begin_frame(void)
+{
+    arena_reset(&tile_arena);
+    item_ranges = NULL;
+
+    num_tiles_x = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+    num_tiles_y = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// Bins the next item by its inclusive screen-space bounding box
+void tiles_bin(int min_x, int min_y, int max_x, int max_y)
+{
+    // Items completely off-screen still get a slot so indices stay aligned, with an empty range
+    tile_range_t range = {1, 1, 0, 0};
+
+    if (max_x >= 0 && max_y >= 0 && min_x < window_width && min_y < window_height)
+    {
+        range.min_x = (min_x > 0 ? min_x : 0) / TILE_SIZE;
+        range.min_y = (min_y > 0 ? min_y : 0) / TILE_SIZE;
+        range.max_x = (max_x < window_width ? max_x : window_width - 1) / TILE_SIZE;
+        range.max_y = (max_y < window_height ? max_y : window_height - 1) / TILE_SIZE;
+    }
+
+    arena_array_push(&tile_arena, item_ranges, range);
+}
+
+void tiles_render(tile_draw_fn draw)
+{
+    int num_items = array_length(item_ranges);
+    int num_tiles = num_tiles_x * num_tiles_y;
+
+    // Count the items of every tile, then turn the counts into offsets
+    tile_offsets = (int *)arena_alloc(&tile_arena, sizeof(int) * (num_tiles + 1));
+    memset(tile_offsets, 0, sizeof(int) * (num_tiles + 1));
+
+    for (int i = 0; i < num_items; i++)
+    {
+        tile_range_t range = item_ranges[i];
+        for (int ty = range.min_y; ty <= range.max_y; ty++)
+        {
+            for (int tx = range.min_x; tx <= range.max_x; tx++)
+            {
+                tile_offsets[ty * num_tiles_x + tx + 1]++;
+            }
+        }
+    }
+
+    for (int t = 0; t < num_tiles; t++)
+    {
+        tile_offsets[t + 1] += tile_offsets[t];
+    }
+
+    // Scatter item indices into the tiles, in item order
+    tile_items = (int *)arena_alloc(&tile_arena, sizeof(int) * (tile_offsets[num_tiles] > 0 ? tile_offsets[num_tiles] : 1));
+    int *cursor = (int *)arena_alloc(&tile_arena, sizeof(int) * num_tiles);
+    memcpy(cursor, tile_offsets, sizeof(int) * num_tiles);
+
+    for (int i = 0; i < num_items; i++)
+    {
+        tile_range_t range = item_ranges[i];
+        for (int ty = range.min_y; ty <= range.max_y; ty++)
+        {
+            for (int tx = range.min_x; tx <= range.max_x; tx++)
+            {
+                tile_items[cursor[ty * num_tiles_x + tx]++] = i;
+            }
+        }
+    }
+
+    // Wake the workers and render tiles on this thread as well until all are taken
+    draw_item = draw;
+    SDL_AtomicSet(&next_tile, 0);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        SDL_SemPost(work_ready);
+    }
+
+    clip_rect_t main_clip_rect = clip_rect;
+    render_tiles();
+    set_clip_rect(main_clip_rect.min_x, main_clip_rect.min_y, main_clip_rect.max_x, main_clip_rect.max_y);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        SDL_SemWait(work_done);
+    }
+}
+
+void tiles_destroy(void)
+{
+    is_shutting_down = true;
+    for (int i = 0; i < num_workers; i++)
+    {
+        SDL_SemPost(work_ready);
+    }
+    for (int i = 0; i < num_workers; i++)
+    {
+        SDL_WaitThread(workers[i], NULL);
+    }
+
+    free(workers);
+    SDL_DestroySemaphore(work_ready);
+    SDL_DestroySemaphore(work_done);
+    arena_free(&tile_arena);
+}
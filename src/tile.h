@@ -0,0 +1,16 @@
+#ifndef TILE_H
+#define TILE_H
+
+// Tiles are square, a multiple of RASTER_BLOCK_SIZE wide
+#define TILE_SIZE 64
+
+// Draws item number index, called once for every tile the item was binned into
+typedef void (*tile_draw_fn)(int index);
+
+void tiles_init(void);
+void tiles_begin_frame(void);
+void tiles_bin(int min_x, int min_y, int max_x, int max_y);
+void tiles_render(tile_draw_fn draw);
+void tiles_destroy(void);
+
+#endif
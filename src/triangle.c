@@ -2,6 +2,16 @@
 #include "triangle.h"
 #include "array.h"
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <immintrin.h>
+#define RASTER_SSE2
+#if defined(__GNUC__)
+#define RASTER_AVX2
+#endif
+#endif
 
 void int_swap(int *a, int *b)
 {
@@ -18,346 +28,679 @@ void float_swap(float *a, float *b)
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a filled a triangle with a flat bottom
+// Edge function of the directed edge (x0,y0)->(x1,y1) evaluated at (px,py)
 ///////////////////////////////////////////////////////////////////////////////
-//
-//        (x0,y0)
-//          / \
-//         /   \
-//        /     \
-//       /       \
-//      /         \
-//  (x1,y1)------(x2,y2)
-//
+// The value is twice the signed area of the triangle formed by the edge and
+// the point, positive on the inner side of a triangle with positive area.
+// It is linear in px and py, so it can be stepped with one add per pixel.
 ///////////////////////////////////////////////////////////////////////////////
-void fill_flat_bottom_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+static int64_t edge_function(int x0, int y0, int x1, int y1, int px, int py)
 {
-    // Find the two slopes (two triangle legs)
-    float inv_slope_1 = (float)(x1 - x0) / (float)(y1 - y0);
-    float inv_slope_2 = (float)(x2 - x0) / (float)(y2 - y0);
-
-    // Start x_start and x_end from the top vertex (x0,y0)
-    float x_start = x0;
-    float x_end = x0;
+    return (int64_t)(x1 - x0) * (py - y0) - (int64_t)(y1 - y0) * (px - x0);
+}
 
-    // Loop all the scanlines from top to bottom
-    for (int y = y0; y <= y2; y++)
-    {
-        draw_line(x_start, y, x_end, y, color);
-        x_start += inv_slope_1;
-        x_end += inv_slope_2;
-    }
+// Top-left fill rule: pixels exactly on an edge only belong to top or left edges,
+// so two triangles sharing an edge never both draw the pixels along it
+static int64_t edge_bias(int x0, int y0, int x1, int y1)
+{
+    bool is_top = (y1 == y0) && (x1 > x0);
+    bool is_left = (y1 < y0);
+    return (is_top || is_left) ? 0 : -1;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// Draw a filled a triangle with a flat top
+// Half-space (edge function) rasterizer
 ///////////////////////////////////////////////////////////////////////////////
+// Setup computes the three edge functions and the screen-space gradients of
+// 1/w, u/w and v/w once per triangle. Rows are then handed to a row kernel:
+// a scalar one, or SSE2 (4 pixels) and AVX2 (8 pixels) ones picked at runtime.
 //
-//  (x0,y0)------(x1,y1)
-//      \         /
-//       \       /
-//        \     /
-//         \   /
-//          \ /
-//        (x2,y2)
-//
+// Attributes are evaluated exactly at the start of each RASTER_BLOCK_SIZE
+// aligned block of columns and every pixel adds its lane offset to that, so
+// all kernels produce bit-identical pixels and the result does not depend on
+// where the clip rect starts a span (tiles match the full-screen output).
 ///////////////////////////////////////////////////////////////////////////////
-void fill_flat_top_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
-{
-    // Find the two slopes (two triangle legs)
-    float inv_slope_1 = (float)(x2 - x0) / (float)(y2 - y0);
-    float inv_slope_2 = (float)(x2 - x1) / (float)(y2 - y1);
 
-    // Start x_start and x_end from the bottom vertex (x2,y2)
-    float x_start = x2;
-    float x_end = x2;
+// Vertex coordinates beyond this make edge functions overflow 32-bit SIMD lanes
+#define RASTER_SIMD_MAX_COORD 16383
+
+// Texture coordinates are clamped to this before wrapping so all the math stays exact in floats
+#define RASTER_MAX_TEXEL_COORD 8388608.0f
 
-    // Loop all the scanlines from bottom to top
-    for (int y = y2; y >= y0; y--)
+typedef struct
+{
+    int min_x, min_y, max_x, max_y; // Bounding box clamped to the clip rect, inclusive
+    int x0, y0;                     // Vertex the attribute planes are anchored at
+    int64_t e_dx[3], e_dy[3];       // Edge function increments, edge i is opposite vertex i
+    int64_t e_min[3];               // Biased edge function values at (min_x, min_y)
+    float rw0, uw0, vw0;            // 1/w, u/w and v/w at (x0, y0)
+    float rw_dx, rw_dy, uw_dx, uw_dy, vw_dx, vw_dy;
+    uint32_t color;
+    uint32_t *texture;
+} raster_setup_t;
+
+typedef void (*raster_row_fn)(const raster_setup_t *r, int y, int64_t e0, int64_t e1, int64_t e2);
+
+// Sets up the edge functions and bounding box, returns false when nothing can be drawn
+static bool raster_setup_edges(raster_setup_t *r, int *x0, int *y0, int *x1, int *y1, int *x2, int *y2, bool *is_swapped)
+{
+    // Make the winding consistent so the inside of the triangle is where all edges are positive
+    int64_t area = edge_function(*x0, *y0, *x1, *y1, *x2, *y2);
+    if (area == 0)
+        return false;
+
+    *is_swapped = area < 0;
+    if (*is_swapped)
     {
-        draw_line(x_start, y, x_end, y, color);
-        x_start -= inv_slope_1;
-        x_end -= inv_slope_2;
+        int_swap(x1, x2);
+        int_swap(y1, y2);
     }
+
+    // Bounding box clamped to the clip rect
+    r->min_x = *x0 < *x1 ? (*x0 < *x2 ? *x0 : *x2) : (*x1 < *x2 ? *x1 : *x2);
+    r->min_y = *y0 < *y1 ? (*y0 < *y2 ? *y0 : *y2) : (*y1 < *y2 ? *y1 : *y2);
+    r->max_x = *x0 > *x1 ? (*x0 > *x2 ? *x0 : *x2) : (*x1 > *x2 ? *x1 : *x2);
+    r->max_y = *y0 > *y1 ? (*y0 > *y2 ? *y0 : *y2) : (*y1 > *y2 ? *y1 : *y2);
+    if (r->min_x < clip_rect.min_x)
+        r->min_x = clip_rect.min_x;
+    if (r->min_y < clip_rect.min_y)
+        r->min_y = clip_rect.min_y;
+    if (r->max_x > clip_rect.max_x - 1)
+        r->max_x = clip_rect.max_x - 1;
+    if (r->max_y > clip_rect.max_y - 1)
+        r->max_y = clip_rect.max_y - 1;
+    if (r->min_x > r->max_x || r->min_y > r->max_y)
+        return false;
+
+    r->x0 = *x0;
+    r->y0 = *y0;
+
+    r->e_dx[0] = *y1 - *y2, r->e_dy[0] = *x2 - *x1;
+    r->e_dx[1] = *y2 - *y0, r->e_dy[1] = *x0 - *x2;
+    r->e_dx[2] = *y0 - *y1, r->e_dy[2] = *x1 - *x0;
+
+    r->e_min[0] = edge_function(*x1, *y1, *x2, *y2, r->min_x, r->min_y) + edge_bias(*x1, *y1, *x2, *y2);
+    r->e_min[1] = edge_function(*x2, *y2, *x0, *y0, r->min_x, r->min_y) + edge_bias(*x2, *y2, *x0, *y0);
+    r->e_min[2] = edge_function(*x0, *y0, *x1, *y1, r->min_x, r->min_y) + edge_bias(*x0, *y0, *x1, *y1);
+
+    return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Draw a filled triangle with the flat-top/flat-bottom method
-// We split the original triangle in two, half flat-bottom and half flat-top
-///////////////////////////////////////////////////////////////////////////////
-//
-//          (x0,y0)
-//            / \
-//           /   \
-//          /     \
-//         /       \
-//        /         \
-//   (x1,y1)------(Mx,My)
-//       \_           \
-//          \_         \
-//             \_       \
-//                \_     \
-//                   \    \
-//                     \_  \
-//                        \_\
-//                           \
-//                         (x2,y2)
-//
-///////////////////////////////////////////////////////////////////////////////
-void draw_filled_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+static bool raster_is_simd_safe(int x0, int y0, int x1, int y1, int x2, int y2)
 {
-    // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1)
+    return abs(x0) <= RASTER_SIMD_MAX_COORD && abs(y0) <= RASTER_SIMD_MAX_COORD &&
+           abs(x1) <= RASTER_SIMD_MAX_COORD && abs(y1) <= RASTER_SIMD_MAX_COORD &&
+           abs(x2) <= RASTER_SIMD_MAX_COORD && abs(y2) <= RASTER_SIMD_MAX_COORD;
+}
+
+// Walks the rows of the bounding box and hands each one to the row kernel
+static void raster_rows(const raster_setup_t *r, raster_row_fn row)
+{
+    int64_t e0 = r->e_min[0];
+    int64_t e1 = r->e_min[1];
+    int64_t e2 = r->e_min[2];
+
+    for (int y = r->min_y; y <= r->max_y; y++)
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
+        row(r, y, e0, e1, e2);
+        e0 += r->e_dy[0];
+        e1 += r->e_dy[1];
+        e2 += r->e_dy[2];
     }
-    if (y1 > y2)
+}
+
+// Wraps a texture coordinate in texels into [0, size), same as abs((int)t) % size
+static int wrap_texel_coord(float t, float size, float inv_size)
+{
+    if (t > RASTER_MAX_TEXEL_COORD)
+        t = RASTER_MAX_TEXEL_COORD;
+    if (t < -RASTER_MAX_TEXEL_COORD)
+        t = -RASTER_MAX_TEXEL_COORD;
+
+    float a = (float)abs((int)t);
+    float r = a - (float)(int)(a * inv_size) * size;
+    if (r >= size)
+        r -= size;
+    if (r < 0)
+        r += size;
+
+    return (int)r;
+}
+
+// Draws the covered, depth-passing pixels of [first_x, last_x] in the block starting at block_x,
+// with the texel at the pixel or, for triangles without a texture, with the flat color
+static void raster_block_depth_scalar(const raster_setup_t *r, int y, int block_x, int first_x, int last_x,
+                                         int64_t e0, int64_t e1, int64_t e2, float rw_row, float uw_row, float vw_row)
+{
+    uint32_t *color_row = &color_buffer[window_width * y];
+    float *z_row = &z_buffer[window_width * y];
+    float size_u = texture_width, size_v = texture_height;
+
+    float rw_block = rw_row + (block_x - r->x0) * r->rw_dx;
+    float uw_block = uw_row + (block_x - r->x0) * r->uw_dx;
+    float vw_block = vw_row + (block_x - r->x0) * r->vw_dx;
+
+    for (int x = first_x; x <= last_x; x++)
     {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
+        // Inside when no edge function is negative
+        if ((e0 | e1 | e2) >= 0)
+        {
+            float lane = x - block_x;
+            float rw = rw_block + lane * r->rw_dx;
+
+            // Adjust 1/w so the pixels that are closer to the camera have smaller values
+            float depth = 1.0f - rw;
+
+            // Only draw the pixel if it is not behind the value previously stored in z-buffer
+            // (equal passes, so textures can be drawn over a flat fill of the same triangle)
+            if (depth <= z_row[x])
+            {
+                if (r->texture == NULL)
+                {
+                    color_row[x] = r->color;
+                }
+                else
+                {
+                    // Divide u/w and v/w back by 1/w to get perspective correct UVs
+                    float w = 1 / rw;
+                    float u = (uw_block + lane * r->uw_dx) * w;
+                    float v = (vw_block + lane * r->vw_dx) * w;
+                    int tex_x = wrap_texel_coord(u * size_u, size_u, 1.0f / size_u);
+                    int tex_y = wrap_texel_coord(v * size_v, size_v, 1.0f / size_v);
+
+                    color_row[x] = r->texture[(texture_width * tex_y) + tex_x];
+                }
+                z_row[x] = depth;
+            }
+        }
+
+        e0 += r->e_dx[0];
+        e1 += r->e_dx[1];
+        e2 += r->e_dx[2];
     }
-    if (y0 > y1)
+}
+
+static void raster_row_depth_scalar(const raster_setup_t *r, int y, int64_t e0, int64_t e1, int64_t e2)
+{
+    // Attribute values at x = x0 on this row
+    float rw_row = r->rw0 + (y - r->y0) * r->rw_dy;
+    float uw_row = r->uw0 + (y - r->y0) * r->uw_dy;
+    float vw_row = r->vw0 + (y - r->y0) * r->vw_dy;
+
+    for (int x = r->min_x; x <= r->max_x;)
     {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
+        int block_x = x & ~(RASTER_BLOCK_SIZE - 1);
+        int last_x = block_x + RASTER_BLOCK_SIZE - 1 < r->max_x ? block_x + RASTER_BLOCK_SIZE - 1 : r->max_x;
+
+        raster_block_depth_scalar(r, y, block_x, x, last_x, e0, e1, e2, rw_row, uw_row, vw_row);
+
+        e0 += (last_x + 1 - x) * r->e_dx[0];
+        e1 += (last_x + 1 - x) * r->e_dx[1];
+        e2 += (last_x + 1 - x) * r->e_dx[2];
+        x = last_x + 1;
     }
+}
 
-    if (y1 == y2)
+// Without depth testing every covered pixel of a row gets the same color, so the row is a
+// single span. Edge i stays non-negative from x = min_x + ceil(-e / e_dx) on when e_dx > 0
+// and up to x = min_x + floor(e / -e_dx) when e_dx < 0, the span is where all three overlap.
+static void raster_row_flat(const raster_setup_t *r, int y, int64_t e0, int64_t e1, int64_t e2)
+{
+    int64_t e[3] = {e0, e1, e2};
+    int64_t first_x = r->min_x;
+    int64_t last_x = r->max_x;
+
+    for (int i = 0; i < 3; i++)
     {
-        // Draw flat-bottom triangle
-        fill_flat_bottom_triangle(x0, y0, x1, y1, x2, y2, color);
+        int64_t dx = r->e_dx[i];
+        if (dx > 0)
+        {
+            if (e[i] < 0)
+            {
+                int64_t x = r->min_x + (-e[i] + dx - 1) / dx;
+                if (x > first_x)
+                    first_x = x;
+            }
+        }
+        else if (dx < 0)
+        {
+            if (e[i] < 0)
+                return;
+
+            int64_t x = r->min_x + e[i] / -dx;
+            if (x < last_x)
+                last_x = x;
+        }
+        else if (e[i] < 0)
+        {
+            return;
+        }
     }
-    else if (y0 == y1)
+
+    if (first_x <= last_x)
+        draw_span((int)first_x, (int)last_x, y, r->color);
+}
+
+// Vector kernels load and store whole blocks, lanes outside the triangle are written
+// back unchanged. That is only allowed while the whole block lies in this thread's
+// clip rect, otherwise the block falls back to the scalar path.
+static bool raster_block_is_owned(int block_x, int width)
+{
+    return block_x >= clip_rect.min_x && block_x + width <= clip_rect.max_x;
+}
+
+#ifdef RASTER_SSE2
+static void raster_row_depth_sse2(const raster_setup_t *r, int y, int64_t e0, int64_t e1, int64_t e2)
+{
+    uint32_t *color_row = &color_buffer[window_width * y];
+    float *z_row = &z_buffer[window_width * y];
+
+    float rw_row = r->rw0 + (y - r->y0) * r->rw_dy;
+    float uw_row = r->uw0 + (y - r->y0) * r->uw_dy;
+    float vw_row = r->vw0 + (y - r->y0) * r->vw_dy;
+
+    __m128i e_lanes[3];
+    for (int i = 0; i < 3; i++)
     {
-        // Draw flat-top triangle
-        fill_flat_top_triangle(x0, y0, x1, y1, x2, y2, color);
+        int d = (int)r->e_dx[i];
+        e_lanes[i] = _mm_setr_epi32(0, d, 2 * d, 3 * d);
     }
-    else
+
+    const __m128 size_u = _mm_set1_ps(texture_width), inv_size_u = _mm_set1_ps(1.0f / texture_width);
+    const __m128 size_v = _mm_set1_ps(texture_height), inv_size_v = _mm_set1_ps(1.0f / texture_height);
+    const __m128 max_coord = _mm_set1_ps(RASTER_MAX_TEXEL_COORD), min_coord = _mm_set1_ps(-RASTER_MAX_TEXEL_COORD);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128i flat_color = _mm_set1_epi32((int)r->color);
+
+    for (int block_x = r->min_x & ~(RASTER_BLOCK_SIZE - 1); block_x <= r->max_x; block_x += RASTER_BLOCK_SIZE)
     {
-        // Calculate the new vertex (Mx,My) using triangle similarity
-        int My = y1;
-        int Mx = (((x2 - x0) * (y1 - y0)) / (y2 - y0)) + x0;
+        float rw_block = rw_row + (block_x - r->x0) * r->rw_dx;
+        float uw_block = uw_row + (block_x - r->x0) * r->uw_dx;
+        float vw_block = vw_row + (block_x - r->x0) * r->vw_dx;
+
+        // Each 8 pixel block is done as two halves of 4 lanes
+        for (int half = 0; half < RASTER_BLOCK_SIZE; half += 4)
+        {
+            int x = block_x + half;
+            int first_x = x > r->min_x ? x : r->min_x;
+            int last_x = x + 3 < r->max_x ? x + 3 : r->max_x;
+            if (first_x > last_x)
+                continue;
+
+            int64_t offset = x - r->min_x;
+            int64_t ex0 = e0 + offset * r->e_dx[0];
+            int64_t ex1 = e1 + offset * r->e_dx[1];
+            int64_t ex2 = e2 + offset * r->e_dx[2];
+
+            if (!raster_block_is_owned(x, 4))
+            {
+                raster_block_depth_scalar(r, y, block_x, first_x, last_x,
+                                             ex0 + (first_x - x) * r->e_dx[0], ex1 + (first_x - x) * r->e_dx[1], ex2 + (first_x - x) * r->e_dx[2],
+                                             rw_row, uw_row, vw_row);
+                continue;
+            }
 
-        // Draw flat-bottom triangle
-        fill_flat_bottom_triangle(x0, y0, x1, y1, Mx, My, color);
+            // Coverage: every edge function non-negative, and the pixel inside the bounding box
+            __m128i edges = _mm_or_si128(_mm_or_si128(
+                                             _mm_add_epi32(_mm_set1_epi32((int)ex0), e_lanes[0]),
+                                             _mm_add_epi32(_mm_set1_epi32((int)ex1), e_lanes[1])),
+                                         _mm_add_epi32(_mm_set1_epi32((int)ex2), e_lanes[2]));
+            __m128i xs = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+            __m128i mask = _mm_cmpgt_epi32(edges, _mm_set1_epi32(-1));
+            mask = _mm_and_si128(mask, _mm_cmpgt_epi32(xs, _mm_set1_epi32(first_x - 1)));
+            mask = _mm_and_si128(mask, _mm_cmplt_epi32(xs, _mm_set1_epi32(last_x + 1)));
+            if (_mm_movemask_epi8(mask) == 0)
+                continue;
+
+            __m128 lane = _mm_setr_ps(half, half + 1, half + 2, half + 3);
+            __m128 rw = _mm_add_ps(_mm_set1_ps(rw_block), _mm_mul_ps(lane, _mm_set1_ps(r->rw_dx)));
+
+            // Depth test
+            __m128 depth = _mm_sub_ps(one, rw);
+            __m128 z_old = _mm_loadu_ps(&z_row[x]);
+            __m128 pass = _mm_and_ps(_mm_castsi128_ps(mask), _mm_cmple_ps(depth, z_old));
+            int pass_bits = _mm_movemask_ps(pass);
+            if (pass_bits == 0)
+                continue;
+
+            _mm_storeu_ps(&z_row[x], _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, z_old)));
+
+            if (r->texture == NULL)
+            {
+                __m128i color_old = _mm_loadu_si128((__m128i *)&color_row[x]);
+                __m128i pass_mask = _mm_castps_si128(pass);
+                _mm_storeu_si128((__m128i *)&color_row[x], _mm_or_si128(_mm_and_si128(pass_mask, flat_color), _mm_andnot_si128(pass_mask, color_old)));
+                continue;
+            }
+
+            // Perspective divide and texel coordinates
+            __m128 w = _mm_div_ps(one, rw);
+            __m128 u = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps(uw_block), _mm_mul_ps(lane, _mm_set1_ps(r->uw_dx))), w), size_u);
+            __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_set1_ps(vw_block), _mm_mul_ps(lane, _mm_set1_ps(r->vw_dx))), w), size_v);
+
+            __m128 wrapped[2];
+            __m128 coords[2] = {u, v};
+            __m128 sizes[2] = {size_u, size_v};
+            __m128 inv_sizes[2] = {inv_size_u, inv_size_v};
+            for (int c = 0; c < 2; c++)
+            {
+                // Same steps as wrap_texel_coord
+                __m128 t = _mm_max_ps(_mm_min_ps(coords[c], max_coord), min_coord);
+                __m128i ti = _mm_cvttps_epi32(t);
+                __m128i sign = _mm_srai_epi32(ti, 31);
+                __m128 a = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_xor_si128(ti, sign), sign));
+                __m128 q = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(a, inv_sizes[c])));
+                __m128 rem = _mm_sub_ps(a, _mm_mul_ps(q, sizes[c]));
+                rem = _mm_sub_ps(rem, _mm_and_ps(_mm_cmpge_ps(rem, sizes[c]), sizes[c]));
+                rem = _mm_add_ps(rem, _mm_and_ps(_mm_cmplt_ps(rem, zero), sizes[c]));
+                wrapped[c] = rem;
+            }
+
+            // No gather in SSE2, fetch the texels of the passing lanes one by one
+            __m128i texel_index = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(wrapped[1], size_u), wrapped[0]));
+            int32_t indices[4];
+            _mm_storeu_si128((__m128i *)indices, texel_index);
 
-        // Draw flat-top triangle
-        fill_flat_top_triangle(x1, y1, Mx, My, x2, y2, color);
+            for (int lane_index = 0; lane_index < 4; lane_index++)
+            {
+                if (pass_bits & (1 << lane_index))
+                    color_row[x + lane_index] = r->texture[indices[lane_index]];
+            }
+        }
     }
 }
+#endif
 
-vec3_t barycentric_weights(vec2_t a, vec2_t b, vec2_t c, vec2_t p)
+#ifdef RASTER_AVX2
+__attribute__((target("avx2"))) static void raster_row_depth_avx2(const raster_setup_t *r, int y, int64_t e0, int64_t e1, int64_t e2)
 {
-    vec2_t ac = vec2_sub(c, a);
-    vec2_t ab = vec2_sub(b, a);
-    vec2_t ap = vec2_sub(p, a);
-    vec2_t pc = vec2_sub(c, p);
-    vec2_t pb = vec2_sub(b, p);
+    uint32_t *color_row = &color_buffer[window_width * y];
+    float *z_row = &z_buffer[window_width * y];
 
-    float area_parellolgram_abc = (ac.x * ab.y - ac.y * ab.x);
+    float rw_row = r->rw0 + (y - r->y0) * r->rw_dy;
+    float uw_row = r->uw0 + (y - r->y0) * r->uw_dy;
+    float vw_row = r->vw0 + (y - r->y0) * r->vw_dy;
 
-    float alpha = (pc.x * pb.y - pc.y * pb.x) / area_parellolgram_abc;
-    float beta = (ac.x * ap.y - ac.y * ap.x) / area_parellolgram_abc;
-    float gamma = 1 - alpha - beta;
+    const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i e_lanes[3];
+    for (int i = 0; i < 3; i++)
+    {
+        e_lanes[i] = _mm256_mullo_epi32(lane_index, _mm256_set1_epi32((int)r->e_dx[i]));
+    }
 
-    vec3_t weights = {alpha, beta, gamma};
+    const __m256 size_u = _mm256_set1_ps(texture_width), inv_size_u = _mm256_set1_ps(1.0f / texture_width);
+    const __m256 size_v = _mm256_set1_ps(texture_height), inv_size_v = _mm256_set1_ps(1.0f / texture_height);
+    const __m256 max_coord = _mm256_set1_ps(RASTER_MAX_TEXEL_COORD), min_coord = _mm256_set1_ps(-RASTER_MAX_TEXEL_COORD);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256i flat_color = _mm256_set1_epi32((int)r->color);
 
-    return weights;
-}
+    for (int block_x = r->min_x & ~(RASTER_BLOCK_SIZE - 1); block_x <= r->max_x; block_x += RASTER_BLOCK_SIZE)
+    {
+        int first_x = block_x > r->min_x ? block_x : r->min_x;
+        int last_x = block_x + 7 < r->max_x ? block_x + 7 : r->max_x;
 
-void draw_texel(int x, int y, uint32_t *texture,                           // texture
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,            // vertex points
-                float u0, float v0, float u1, float v1, float u2, float v2 // UV coords
-)
-{
-    vec2_t point_p = {x, y};
-    vec2_t a = vec2_from_vec4(point_a);
-    vec2_t b = vec2_from_vec4(point_b);
-    vec2_t c = vec2_from_vec4(point_c);
+        int64_t offset = block_x - r->min_x;
+        int64_t ex0 = e0 + offset * r->e_dx[0];
+        int64_t ex1 = e1 + offset * r->e_dx[1];
+        int64_t ex2 = e2 + offset * r->e_dx[2];
 
-    vec3_t weights = barycentric_weights(a, b, c, point_p);
+        if (!raster_block_is_owned(block_x, RASTER_BLOCK_SIZE))
+        {
+            raster_block_depth_scalar(r, y, block_x, first_x, last_x,
+                                         ex0 + (first_x - block_x) * r->e_dx[0], ex1 + (first_x - block_x) * r->e_dx[1], ex2 + (first_x - block_x) * r->e_dx[2],
+                                         rw_row, uw_row, vw_row);
+            continue;
+        }
 
-    float alpha = weights.x;
-    float beta = weights.y;
-    float gamma = weights.z;
+        // Coverage: every edge function non-negative, and the pixel inside the bounding box
+        __m256i edges = _mm256_or_si256(_mm256_or_si256(
+                                            _mm256_add_epi32(_mm256_set1_epi32((int)ex0), e_lanes[0]),
+                                            _mm256_add_epi32(_mm256_set1_epi32((int)ex1), e_lanes[1])),
+                                        _mm256_add_epi32(_mm256_set1_epi32((int)ex2), e_lanes[2]));
+        __m256i xs = _mm256_add_epi32(_mm256_set1_epi32(block_x), lane_index);
+        __m256i mask = _mm256_cmpgt_epi32(edges, _mm256_set1_epi32(-1));
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(xs, _mm256_set1_epi32(first_x - 1)));
+        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_set1_epi32(last_x + 1), xs));
+        if (_mm256_testz_si256(mask, mask))
+            continue;
+
+        float rw_block = rw_row + (block_x - r->x0) * r->rw_dx;
+        float uw_block = uw_row + (block_x - r->x0) * r->uw_dx;
+        float vw_block = vw_row + (block_x - r->x0) * r->vw_dx;
+        __m256 rw = _mm256_add_ps(_mm256_set1_ps(rw_block), _mm256_mul_ps(lane, _mm256_set1_ps(r->rw_dx)));
+
+        // Depth test
+        __m256 depth = _mm256_sub_ps(one, rw);
+        __m256 z_old = _mm256_loadu_ps(&z_row[block_x]);
+        __m256 pass = _mm256_and_ps(_mm256_castsi256_ps(mask), _mm256_cmp_ps(depth, z_old, _CMP_LE_OQ));
+        if (_mm256_testz_ps(pass, pass))
+            continue;
+
+        _mm256_storeu_ps(&z_row[block_x], _mm256_blendv_ps(z_old, depth, pass));
+
+        __m256i color_old = _mm256_loadu_si256((__m256i *)&color_row[block_x]);
+        if (r->texture == NULL)
+        {
+            _mm256_storeu_si256((__m256i *)&color_row[block_x], _mm256_blendv_epi8(color_old, flat_color, _mm256_castps_si256(pass)));
+            continue;
+        }
 
-    float interpolated_u;
-    float interpolated_v;
-    float interpolated_reciprocal_w;
+        // Perspective divide and texel coordinates
+        __m256 w = _mm256_div_ps(one, rw);
+        __m256 u = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(uw_block), _mm256_mul_ps(lane, _mm256_set1_ps(r->uw_dx))), w), size_u);
+        __m256 v = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps(vw_block), _mm256_mul_ps(lane, _mm256_set1_ps(r->vw_dx))), w), size_v);
 
-    // Interpolation of all U/w and V/w values using barycentric weights
-    // And a factor of 1/w
-    interpolated_u = (u0 / point_a.w) * alpha + (u1 / point_b.w) * beta + (u2 / point_c.w) * gamma;
-    interpolated_v = (v0 / point_a.w) * alpha + (v1 / point_b.w) * beta + (v2 / point_c.w) * gamma;
+        __m256 wrapped[2];
+        __m256 coords[2] = {u, v};
+        __m256 sizes[2] = {size_u, size_v};
+        __m256 inv_sizes[2] = {inv_size_u, inv_size_v};
+        for (int c = 0; c < 2; c++)
+        {
+            // Same steps as wrap_texel_coord
+            __m256 t = _mm256_max_ps(_mm256_min_ps(coords[c], max_coord), min_coord);
+            __m256 a = _mm256_cvtepi32_ps(_mm256_abs_epi32(_mm256_cvttps_epi32(t)));
+            __m256 q = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_mul_ps(a, inv_sizes[c])));
+            __m256 rem = _mm256_sub_ps(a, _mm256_mul_ps(q, sizes[c]));
+            rem = _mm256_sub_ps(rem, _mm256_and_ps(_mm256_cmp_ps(rem, sizes[c], _CMP_GE_OQ), sizes[c]));
+            rem = _mm256_add_ps(rem, _mm256_and_ps(_mm256_cmp_ps(rem, zero, _CMP_LT_OQ), sizes[c]));
+            wrapped[c] = rem;
+        }
 
-    // also interpolate the value of 1/w for the current pixel
-    interpolated_reciprocal_w = (1 / point_a.w) * alpha + (1 / point_b.w) * beta + (1 / point_c.w) * gamma;
+        // Gather the texels of passing lanes, the others keep the current color
+        __m256i texel_index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(wrapped[1], size_u), wrapped[0]));
+        __m256i color = _mm256_mask_i32gather_epi32(color_old, (const int *)r->texture, texel_index, _mm256_castps_si256(pass), 4);
 
-    // now we ca ndivide back both interpolated value by 1/w
-    interpolated_u /= interpolated_reciprocal_w;
-    interpolated_v /= interpolated_reciprocal_w;
+        _mm256_storeu_si256((__m256i *)&color_row[block_x], color);
+    }
+}
+#endif
 
-    int tex_x = abs((int)(interpolated_u * texture_width)) % texture_width;
-    int tex_y = abs((int)(interpolated_v * texture_height)) % texture_height;
+// Row kernel in use for depth tested triangles, init_raster_kernels upgrades it to the
+// widest the CPU supports
+static raster_row_fn raster_row_depth = raster_row_depth_scalar;
 
-    // Adjust 1/w so the pixels that are closer to the camera have smaller values
-    interpolated_reciprocal_w = 1.0 - interpolated_reciprocal_w;
+void init_raster_kernels(void)
+{
+#ifdef RASTER_SSE2
+    if (SDL_HasSSE2())
+    {
+        raster_row_depth = raster_row_depth_sse2;
+    }
+#endif
+#ifdef RASTER_AVX2
+    if (SDL_HasAVX2())
+    {
+        raster_row_depth = raster_row_depth_avx2;
+    }
+#endif
+}
 
-    // Only draw the pixel if the depth value is less than the previously stored in z-buffer
-    if (interpolated_reciprocal_w < z_buffer[(window_width * y) + x])
+// 1/w is linear in screen space, derive its gradients and those of u/w and v/w from the edge gradients
+static void raster_setup_attributes(raster_setup_t *r, int x0, int y0, int x1, int y1, int x2, int y2,
+                                    float w0, float w1, float w2, float u0, float v0, float u1, float v1, float u2, float v2)
+{
+    float inv_area = 1.0f / (float)edge_function(x0, y0, x1, y1, x2, y2);
+    float rw0 = 1 / w0, rw1 = 1 / w1, rw2 = 1 / w2;
+    float uw0 = u0 * rw0, uw1 = u1 * rw1, uw2 = u2 * rw2;
+    float vw0 = v0 * rw0, vw1 = v1 * rw1, vw2 = v2 * rw2;
+
+    r->rw0 = rw0;
+    r->uw0 = uw0;
+    r->vw0 = vw0;
+    r->rw_dx = (r->e_dx[0] * rw0 + r->e_dx[1] * rw1 + r->e_dx[2] * rw2) * inv_area;
+    r->rw_dy = (r->e_dy[0] * rw0 + r->e_dy[1] * rw1 + r->e_dy[2] * rw2) * inv_area;
+    r->uw_dx = (r->e_dx[0] * uw0 + r->e_dx[1] * uw1 + r->e_dx[2] * uw2) * inv_area;
+    r->uw_dy = (r->e_dy[0] * uw0 + r->e_dy[1] * uw1 + r->e_dy[2] * uw2) * inv_area;
+    r->vw_dx = (r->e_dx[0] * vw0 + r->e_dx[1] * vw1 + r->e_dx[2] * vw2) * inv_area;
+    r->vw_dy = (r->e_dy[0] * vw0 + r->e_dy[1] * vw1 + r->e_dy[2] * vw2) * inv_area;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a filled triangle with a flat color, depth tested while the z-buffer
+// is enabled, painted over whatever is there otherwise
+///////////////////////////////////////////////////////////////////////////////
+void draw_filled_triangle(
+    int x0, int y0, float w0, // 1
+    int x1, int y1, float w1, // 2
+    int x2, int y2, float w2, // 3
+    uint32_t color)
+{
+    raster_setup_t r;
+    bool is_swapped;
+    if (!raster_setup_edges(&r, &x0, &y0, &x1, &y1, &x2, &y2, &is_swapped))
+        return;
+
+    r.color = color;
+    r.texture = NULL;
+
+    if (!is_depth_test_enabled)
     {
-        draw_pixel(x, y, texture[(texture_width * tex_y) + tex_x]);
+        raster_rows(&r, raster_row_flat);
+        return;
+    }
 
-        // Update z buffer
-        z_buffer[(window_width * y) + x] = interpolated_reciprocal_w;
+    if (is_swapped)
+    {
+        float_swap(&w1, &w2);
     }
+
+    raster_setup_attributes(&r, x0, y0, x1, y1, x2, y2, w0, w1, w2, 0, 0, 0, 0, 0, 0);
+    raster_rows(&r, raster_is_simd_safe(x0, y0, x1, y1, x2, y2) ? raster_row_depth : raster_row_depth_scalar);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Draw a textured triangle with perspective correct UVs and depth testing
+///////////////////////////////////////////////////////////////////////////////
 void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0, // 1
-    int x1, int y1, float z1, float w1, float u1, float v1, // 2
-    int x2, int y2, float z2, float w2, float u2, float v2, // 3
+    int x0, int y0, float w0, float u0, float v0, // 1
+    int x1, int y1, float w1, float u1, float v1, // 2
+    int x2, int y2, float w2, float u2, float v2, // 3
     uint32_t *texture)
 {
-    // We need to sort the vertices by y-coordinate ascending (y0 < y1 < y2)
-    if (y0 > y1)
-    {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
-    if (y1 > y2)
+    raster_setup_t r;
+    bool is_swapped;
+    if (!raster_setup_edges(&r, &x0, &y0, &x1, &y1, &x2, &y2, &is_swapped))
+        return;
+
+    if (is_swapped)
     {
-        int_swap(&y1, &y2);
-        int_swap(&x1, &x2);
-        float_swap(&z1, &z2);
         float_swap(&w1, &w2);
         float_swap(&u1, &u2);
         float_swap(&v1, &v2);
     }
-    if (y0 > y1)
-    {
-        int_swap(&y0, &y1);
-        int_swap(&x0, &x1);
-        float_swap(&z0, &z1);
-        float_swap(&w0, &w1);
-        float_swap(&u0, &u1);
-        float_swap(&v0, &v1);
-    }
 
     // Flip the V component to account for inverted UV-coordinates
     v0 = 1.0 - v0;
     v1 = 1.0 - v1;
     v2 = 1.0 - v2;
 
-    // Create vector points from sorted vertices
-    vec4_t point_a = {x0, y0, z0, w0};
-    vec4_t point_b = {x1, y1, z1, w1};
-    vec4_t point_c = {x2, y2, z2, w2};
+    raster_setup_attributes(&r, x0, y0, x1, y1, x2, y2, w0, w1, w2, u0, v0, u1, v1, u2, v2);
+    r.texture = texture;
 
-    // Render the upper part of the triangle (flat bottom)
-    // ------ FLAT BOTTOM -------
-    float inv_slope_1 = 0;
-    float inv_slope_2 = 0;
-
-    if (y1 - y0 != 0)
-        inv_slope_1 = (float)(x1 - x0) / abs(y1 - y0);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
-
-    if (y1 - y0 != 0)
-    {
-        for (int y = y0; y < y1; y++)
-        {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+    raster_rows(&r, raster_is_simd_safe(x0, y0, x1, y1, x2, y2) ? raster_row_depth : raster_row_depth_scalar);
+}
 
-            if (x_end < x_start) // Swap if x_end is to the left of start
-            {
-                int_swap(&x_start, &x_end);
-            }
+///////////////////////////////////////////////////////////////////////////////
+// Painter's sort
+///////////////////////////////////////////////////////////////////////////////
+// Triangles are ordered back to front with an LSD radix sort over 32-bit keys
+// derived from avg_depth. Only the 8-byte (key, index) pairs move, the
+// triangles stay where they were pushed and are drawn through the indices.
+///////////////////////////////////////////////////////////////////////////////
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (32 / RADIX_BITS)
 
-            for (int x = x_start; x < x_end; x++)
-            {
-                draw_texel(
-                    x, y,    // P
-                    texture, // Texture
-                    point_a, // A
-                    point_b, // B
-                    point_c, // C
-                    u0, v0,  // UV1
-                    u1, v1,  // UV2
-                    u2, v2   // UV3
-                );
-            }
-        }
-    }
+// Maps a depth to a key whose ascending unsigned order is descending depth
+static uint32_t depth_to_sort_key(float depth)
+{
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
 
-    // Render the bottom part of the triangle (flat top)
-    // ------ FLAT TOP ------
-    inv_slope_1 = 0;
-    inv_slope_2 = 0;
+    // Flip negative floats entirely and set the sign bit of positive ones so
+    // the IEEE bit patterns compare like the values, then invert for far-to-near
+    uint32_t mask = (bits & 0x80000000) ? 0xFFFFFFFF : 0x80000000;
+    return ~(bits ^ mask);
+}
 
-    if (y2 - y1 != 0)
-        inv_slope_1 = (float)(x2 - x1) / abs(y2 - y1);
-    if (y2 - y0 != 0)
-        inv_slope_2 = (float)(x2 - x0) / abs(y2 - y0);
+// Sorts count keys by depth_key, returns whichever buffer holds the result
+static triangle_sort_key_t *radix_sort_keys(triangle_sort_key_t *keys, triangle_sort_key_t *scratch, int count)
+{
+    if (count == 0)
+        return keys;
 
-    if (y2 - y1 != 0)
+    for (int pass = 0; pass < RADIX_PASSES; pass++)
     {
-        for (int y = y1; y < y2; y++)
+        int shift = pass * RADIX_BITS;
+        int offsets[RADIX_BUCKETS] = {0};
+
+        for (int i = 0; i < count; i++)
         {
-            int x_start = x1 + (y - y1) * inv_slope_1;
-            int x_end = x0 + (y - y0) * inv_slope_2;
+            offsets[(keys[i].depth_key >> shift) & (RADIX_BUCKETS - 1)]++;
+        }
 
-            if (x_end < x_start) // Swap if x_end is to the left of start
-            {
-                int_swap(&x_start, &x_end);
-            }
+        // Every key has the same digit in this pass, the order would not change
+        if (offsets[(keys[0].depth_key >> shift) & (RADIX_BUCKETS - 1)] == count)
+            continue;
 
-            for (int x = x_start; x < x_end; x++)
-            {
-                draw_texel(
-                    x, y,    // P
-                    texture, // Texture
-                    point_a, // A
-                    point_b, // B
-                    point_c, // C
-                    u0, v0,  // UV1
-                    u1, v1,  // UV2
-                    u2, v2   // UV3
-                );
-            }
+        // Turn the histogram into bucket start offsets
+        int sum = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++)
+        {
+            int bucket_count = offsets[b];
+            offsets[b] = sum;
+            sum += bucket_count;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            scratch[offsets[(keys[i].depth_key >> shift) & (RADIX_BUCKETS - 1)]++] = keys[i];
         }
+
+        triangle_sort_key_t *tmp = keys;
+        keys = scratch;
+        scratch = tmp;
     }
+
+    return keys;
 }
 
-void sort_triangles(triangle_t *triangles)
+////////////////////////////////////////////////////////////////////////////////
+// Returns the triangles in back to front draw order as (key, index) pairs.
+// The keys are taken from the arena and valid until it is reset.
+////////////////////////////////////////////////////////////////////////////////
+triangle_sort_key_t *sort_triangles(triangle_t *triangles, arena_t *arena)
 {
-    if (triangles == NULL)
-    {
-        printf("Triangles are null");
-        return;
-    }
-
     int length = array_length(triangles);
+    triangle_sort_key_t *sort_keys = arena_alloc(arena, sizeof(triangle_sort_key_t) * length);
+    triangle_sort_key_t *sort_keys_scratch = arena_alloc(arena, sizeof(triangle_sort_key_t) * length);
 
-    for (int i = 1; i < length; i++)
+    for (int i = 0; i < length; i++)
     {
-        for (int j = i; j < length; j++)
-        {
-            triangle_t t_1 = triangles[i];
-            triangle_t t_2 = triangles[j];
-
-            if (t_1.avg_depth < t_2.avg_depth)
-            {
-                triangles[i] = t_2;
-                triangles[j] = t_1;
-            }
-        }
+        sort_keys[i].depth_key = depth_to_sort_key(triangles[i].avg_depth);
+        sort_keys[i].index = i;
     }
-}
\ No newline at end of file
+
+    return radix_sort_keys(sort_keys, sort_keys_scratch, length);
+}
@@ -4,15 +4,17 @@
 #include <stdint.h>
 #include "vector.h"
 #include "texture.h"
+#include "array.h"
 
+// Pixel columns the rasterizer steps between exact attribute evaluations, tile sizes must be a multiple of it
+#define RASTER_BLOCK_SIZE 8
+
+// Indices of the three mesh vertices of a face
 typedef struct
 {
     int a;
     int b;
     int c;
-    tex2_t a_uv;
-    tex2_t b_uv;
-    tex2_t c_uv;
     uint32_t color;
 } face_t;
 
@@ -24,18 +26,25 @@ typedef struct
     float avg_depth;
 } triangle_t;
 
-void draw_filled_triangle(int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
-void sort_triangles(triangle_t *array);
+// Compact record sorted in place of the triangles themselves
+typedef struct
+{
+    uint32_t depth_key;
+    uint32_t index;
+} triangle_sort_key_t;
 
-void draw_texel(int x, int y, uint32_t *texture,                           // texture
-                vec4_t point_a, vec4_t point_b, vec4_t point_c,            // vertex points
-                float u0, float v0, float u1, float v1, float u2, float v2 // UV coords
-);
+void init_raster_kernels(void);
+void draw_filled_triangle(
+    int x0, int y0, float w0, // 1
+    int x1, int y1, float w1, // 2
+    int x2, int y2, float w2, // 3
+    uint32_t color);
+triangle_sort_key_t *sort_triangles(triangle_t *triangles, arena_t *arena);
 
 void draw_textured_triangle(
-    int x0, int y0, float z0, float w0, float u0, float v0, // 1
-    int x1, int y1, float z1, float w1, float u1, float v1, // 2
-    int x2, int y2, float z2, float w2, float u2, float v2, // 3
+    int x0, int y0, float w0, float u0, float v0, // 1
+    int x1, int y1, float w1, float u1, float v1, // 2
+    int x2, int y2, float w2, float u2, float v2, // 3
     uint32_t *texture);
 
 #endif
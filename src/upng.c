@@ -28,11 +28,12 @@ freely, subject to the following restrictions:
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "upng.h"
 
 #define MAKE_BYTE(b) ((b) & 0xFF)
-#define MAKE_DWORD(a, b, c, d) ((MAKE_BYTE(a) << 24) | (MAKE_BYTE(b) << 16) | (MAKE_BYTE(c) << 8) | MAKE_BYTE(d))
+#define MAKE_DWORD(a, b, c, d) (((unsigned)MAKE_BYTE(a) << 24) | ((unsigned)MAKE_BYTE(b) << 16) | ((unsigned)MAKE_BYTE(c) << 8) | (unsigned)MAKE_BYTE(d))
 #define MAKE_DWORD_PTR(p) MAKE_DWORD((p)[0], (p)[1], (p)[2], (p)[3])
 
 #define CHUNK_IHDR MAKE_DWORD('I', 'H', 'D', 'R')
@@ -47,14 +48,11 @@ freely, subject to the following restrictions:
 #define NUM_CODE_LENGTH_CODES 19     /*the code length codes. 0-15: code lengths, 16: copy previous 3-6 times, 17: 3-10 zeros, 18: 11-138 zeros */
 #define MAX_SYMBOLS 288              /* largest number of symbols used by any tree type */
 
-#define DEFLATE_CODE_BITLEN 15
-#define DISTANCE_BITLEN 15
-#define CODE_LENGTH_BITLEN 7
 #define MAX_BIT_LENGTH 15 /* largest bitlen used by any tree type */
 
-#define DEFLATE_CODE_BUFFER_SIZE (NUM_DEFLATE_CODE_SYMBOLS * 2)
-#define DISTANCE_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
-#define CODE_LENGTH_BUFFER_SIZE (NUM_DISTANCE_SYMBOLS * 2)
+#define HUFFMAN_FAST_BITS 9                        /* codes up to this long decode with a single table lookup */
+#define HUFFMAN_FAST_SIZE (1 << HUFFMAN_FAST_BITS) /* entries of the lookup table */
+#define HUFFMAN_SYMBOL_BITS 9                      /* bits of a lookup table entry holding the symbol, enough for MAX_SYMBOLS */
 
 #define SET_ERROR(upng, code)          \
     do                                 \
@@ -111,9 +109,12 @@ struct upng_t
 
 typedef struct huffman_tree
 {
-    unsigned *tree2d;
-    unsigned maxbitlen; /*maximum number of bits a single code can get */
-    unsigned numcodes;  /*number of symbols in the alphabet = number of codes */
+    unsigned short fast[HUFFMAN_FAST_SIZE];   /*indexed by the next HUFFMAN_FAST_BITS input bits: code length << HUFFMAN_SYMBOL_BITS | symbol, 0 when the code is longer */
+    unsigned short symbols[MAX_SYMBOLS];      /*the symbols that have a code, ordered by their code */
+    unsigned firstcode[MAX_BIT_LENGTH + 1];   /*first code of each length */
+    unsigned firstsymbol[MAX_BIT_LENGTH + 1]; /*index in symbols of the first code of each length */
+    unsigned maxcode[MAX_BIT_LENGTH + 1];     /*first code past the codes of each length, left aligned to 16 bits */
+    unsigned numcodes;                        /*number of symbols in the alphabet = number of codes */
 } huffman_tree;
 
 static const unsigned LENGTH_BASE[29] = {/*the base lengths represented by codes 257-285 */
@@ -135,191 +136,295 @@ static const unsigned DISTANCE_EXTRA[30] = {/*the extra bits of backwards distan
 static const unsigned CLCL[NUM_CODE_LENGTH_CODES] /*the order in which "code length alphabet code lengths" are stored, out of this the huffman tree of the dynamic huffman tree lengths is generated */
     = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
-static const unsigned FIXED_DEFLATE_CODE_TREE[NUM_DEFLATE_CODE_SYMBOLS * 2] = {
-    289, 370, 290, 307, 546, 291, 561, 292, 293, 300, 294, 297, 295, 296, 0, 1,
-    2, 3, 298, 299, 4, 5, 6, 7, 301, 304, 302, 303, 8, 9, 10, 11, 305, 306, 12,
-    13, 14, 15, 308, 339, 309, 324, 310, 317, 311, 314, 312, 313, 16, 17, 18,
-    19, 315, 316, 20, 21, 22, 23, 318, 321, 319, 320, 24, 25, 26, 27, 322, 323,
-    28, 29, 30, 31, 325, 332, 326, 329, 327, 328, 32, 33, 34, 35, 330, 331, 36,
-    37, 38, 39, 333, 336, 334, 335, 40, 41, 42, 43, 337, 338, 44, 45, 46, 47,
-    340, 355, 341, 348, 342, 345, 343, 344, 48, 49, 50, 51, 346, 347, 52, 53,
-    54, 55, 349, 352, 350, 351, 56, 57, 58, 59, 353, 354, 60, 61, 62, 63, 356,
-    363, 357, 360, 358, 359, 64, 65, 66, 67, 361, 362, 68, 69, 70, 71, 364,
-    367, 365, 366, 72, 73, 74, 75, 368, 369, 76, 77, 78, 79, 371, 434, 372,
-    403, 373, 388, 374, 381, 375, 378, 376, 377, 80, 81, 82, 83, 379, 380, 84,
-    85, 86, 87, 382, 385, 383, 384, 88, 89, 90, 91, 386, 387, 92, 93, 94, 95,
-    389, 396, 390, 393, 391, 392, 96, 97, 98, 99, 394, 395, 100, 101, 102, 103,
-    397, 400, 398, 399, 104, 105, 106, 107, 401, 402, 108, 109, 110, 111, 404,
-    419, 405, 412, 406, 409, 407, 408, 112, 113, 114, 115, 410, 411, 116, 117,
-    118, 119, 413, 416, 414, 415, 120, 121, 122, 123, 417, 418, 124, 125, 126,
-    127, 420, 427, 421, 424, 422, 423, 128, 129, 130, 131, 425, 426, 132, 133,
-    134, 135, 428, 431, 429, 430, 136, 137, 138, 139, 432, 433, 140, 141, 142,
-    143, 435, 483, 436, 452, 568, 437, 438, 445, 439, 442, 440, 441, 144, 145,
-    146, 147, 443, 444, 148, 149, 150, 151, 446, 449, 447, 448, 152, 153, 154,
-    155, 450, 451, 156, 157, 158, 159, 453, 468, 454, 461, 455, 458, 456, 457,
-    160, 161, 162, 163, 459, 460, 164, 165, 166, 167, 462, 465, 463, 464, 168,
-    169, 170, 171, 466, 467, 172, 173, 174, 175, 469, 476, 470, 473, 471, 472,
-    176, 177, 178, 179, 474, 475, 180, 181, 182, 183, 477, 480, 478, 479, 184,
-    185, 186, 187, 481, 482, 188, 189, 190, 191, 484, 515, 485, 500, 486, 493,
-    487, 490, 488, 489, 192, 193, 194, 195, 491, 492, 196, 197, 198, 199, 494,
-    497, 495, 496, 200, 201, 202, 203, 498, 499, 204, 205, 206, 207, 501, 508,
-    502, 505, 503, 504, 208, 209, 210, 211, 506, 507, 212, 213, 214, 215, 509,
-    512, 510, 511, 216, 217, 218, 219, 513, 514, 220, 221, 222, 223, 516, 531,
-    517, 524, 518, 521, 519, 520, 224, 225, 226, 227, 522, 523, 228, 229, 230,
-    231, 525, 528, 526, 527, 232, 233, 234, 235, 529, 530, 236, 237, 238, 239,
-    532, 539, 533, 536, 534, 535, 240, 241, 242, 243, 537, 538, 244, 245, 246,
-    247, 540, 543, 541, 542, 248, 249, 250, 251, 544, 545, 252, 253, 254, 255,
-    547, 554, 548, 551, 549, 550, 256, 257, 258, 259, 552, 553, 260, 261, 262,
-    263, 555, 558, 556, 557, 264, 265, 266, 267, 559, 560, 268, 269, 270, 271,
-    562, 565, 563, 564, 272, 273, 274, 275, 566, 567, 276, 277, 278, 279, 569,
-    572, 570, 571, 280, 281, 282, 283, 573, 574, 284, 285, 286, 287, 0, 0};
-
-static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
-    33, 48, 34, 41, 35, 38, 36, 37, 0, 1, 2, 3, 39, 40, 4, 5, 6, 7, 42, 45, 43,
-    44, 8, 9, 10, 11, 46, 47, 12, 13, 14, 15, 49, 56, 50, 53, 51, 52, 16, 17,
-    18, 19, 54, 55, 20, 21, 22, 23, 57, 60, 58, 59, 24, 25, 26, 27, 61, 62, 28,
-    29, 30, 31, 0, 0};
-
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+/*the zlib data is read through a 64-bit accumulator, lsb first. A refill tops it up to at least BIT_READER_FULL bits with a single load, after that fields are read with a shift and a mask and need no further checks. The data is read in place from the payloads of the IDAT chunks, one after the other*/
+#define BIT_READER_FULL 56 /* enough for a length code, its extra bits, a distance code and its extra bits: 15 + 5 + 15 + 13 */
+
+typedef struct bit_reader
 {
-    unsigned char result = (unsigned char)((bitstream[(*bitpointer) >> 3] >> ((*bitpointer) & 0x7)) & 1);
-    (*bitpointer)++;
-    return result;
+    const unsigned char *chunk; /*the IDAT chunk being read */
+    const unsigned char *end;   /*end of the chunks, the IDAT chunks after the current one are searched up to here */
+    const unsigned char *in;    /*payload of the chunk */
+    unsigned long size;         /*bytes in the payload */
+    unsigned long pos;          /*next byte of the payload to load, may run past size by the zeros loaded after the last chunk */
+    uint64_t bits;              /*loaded bits that aren't consumed yet, the next one lowest */
+    unsigned count;             /*number of loaded bits */
+} bit_reader;
+
+static void bit_reader_set_chunk(bit_reader *br, const unsigned char *chunk)
+{
+    br->chunk = chunk;
+    br->in = chunk + 8;
+    br->size = upng_chunk_length(chunk);
+    br->pos = 0;
 }
 
-static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream, unsigned long nbits)
+/*the chunks up to end must have been checked to lie within the source*/
+static void bit_reader_init(bit_reader *br, const unsigned char *chunk, const unsigned char *end)
 {
-    unsigned result = 0, i;
-    for (i = 0; i < nbits; i++)
-        result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
+    bit_reader_set_chunk(br, chunk);
+    br->end = end;
+    br->bits = 0;
+    br->count = 0;
+}
+
+/*moves on to the payload of the next IDAT chunk, returns 0 when there is none*/
+static int bit_reader_next_chunk(bit_reader *br)
+{
+    const unsigned char *chunk = br->chunk + upng_chunk_length(br->chunk) + 12;
+    while (chunk < br->end && upng_chunk_type(chunk) != CHUNK_IEND)
+    {
+        if (upng_chunk_type(chunk) == CHUNK_IDAT)
+        {
+            bit_reader_set_chunk(br, chunk);
+            return 1;
+        }
+        chunk += upng_chunk_length(chunk) + 12;
+    }
+    return 0;
+}
+
+static uint64_t load_le64(const unsigned char *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void bit_reader_refill(upng_t *upng, bit_reader *br)
+{
+    if (br->pos + 8 <= br->size)
+    {
+        /* load a whole word and keep the whole bytes that fit, the bits above count are loaded again by the next refill */
+        br->bits |= load_le64(br->in + br->pos) << br->count;
+        br->pos += (63 - br->count) >> 3;
+        br->count |= BIT_READER_FULL;
+    }
+    else
+    {
+        /* near the end of a chunk bytes go in one at a time, then from the next chunk, and zeros after the last one */
+        while (br->count < BIT_READER_FULL)
+        {
+            while (br->pos == br->size && bit_reader_next_chunk(br))
+            {
+            }
+            if (br->pos < br->size)
+            {
+                br->bits |= (uint64_t)br->in[br->pos] << br->count;
+            }
+            br->pos++;
+            br->count += 8;
+        }
+
+        /* error: a stream that needs more than a whole refill of zeros is truncated */
+        if (br->pos > br->size + 8)
+        {
+            SET_ERROR(upng, UPNG_EMALFORMED);
+        }
+    }
+}
+
+/*nbits must not be more than the loaded count*/
+static unsigned bit_reader_bits(bit_reader *br, unsigned nbits)
+{
+    unsigned result = (unsigned)(br->bits & ((1u << nbits) - 1));
+    br->bits >>= nbits;
+    br->count -= nbits;
     return result;
 }
 
-/* the buffer must be numcodes*2 in size! */
-static void huffman_tree_init(huffman_tree *tree, unsigned *buffer, unsigned numcodes, unsigned maxbitlen)
+static unsigned read_bits(upng_t *upng, bit_reader *br, unsigned nbits)
+{
+    if (br->count < nbits)
+    {
+        bit_reader_refill(upng, br);
+    }
+    return bit_reader_bits(br, nbits);
+}
+
+/*whether bits were read from the zeros loaded after the last chunk*/
+static int bit_reader_overrun(const bit_reader *br)
 {
-    tree->tree2d = buffer;
+    return br->pos > br->size && (br->pos - br->size) * 8 > br->count;
+}
+
+/*copies the next len bytes to out, the reader must be at a byte boundary*/
+static void bit_reader_copy(upng_t *upng, bit_reader *br, unsigned char *out, unsigned long len)
+{
+    /* the whole bytes still loaded come first */
+    while (len > 0 && br->count >= 8)
+    {
+        *out++ = (unsigned char)bit_reader_bits(br, 8);
+        len--;
+    }
+
+    /* then the rest straight from the chunks, which leaves the loaded bits past count behind */
+    if (len > 0)
+    {
+        br->bits = 0;
+    }
+
+    while (len > 0)
+    {
+        unsigned long n;
 
+        /* error: the data ends before the copy does */
+        if (br->pos >= br->size && (br->pos > br->size || !bit_reader_next_chunk(br)))
+        {
+            SET_ERROR(upng, UPNG_EMALFORMED);
+            return;
+        }
+
+        n = br->size - br->pos;
+        if (n > len)
+        {
+            n = len;
+        }
+
+        memcpy(out, br->in + br->pos, n);
+        out += n;
+        br->pos += n;
+        len -= n;
+    }
+}
+
+static void huffman_tree_init(huffman_tree *tree, unsigned numcodes)
+{
     tree->numcodes = numcodes;
-    tree->maxbitlen = maxbitlen;
 }
 
-/*given the code lengths (as stored in the PNG file), generate the tree as defined by Deflate. maxbitlen is the maximum bits that a code in the tree can have. return value is error.*/
+/*the nbits lowest bits of code in reverse order*/
+static unsigned reverse_bits(unsigned code, unsigned nbits)
+{
+    unsigned result = 0, i;
+    for (i = 0; i < nbits; i++)
+    {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
+}
+
+/*given the code lengths (as stored in the PNG file), generate the lookup tables of the canonical code defined by Deflate. Codes up to HUFFMAN_FAST_BITS long get entries in the fast table, longer codes are found by comparing against the first code of each length. return value is error.*/
 static void huffman_tree_create_lengths(upng_t *upng, huffman_tree *tree, const unsigned *bitlen)
 {
-    unsigned tree1d[MAX_SYMBOLS];
-    unsigned blcount[MAX_BIT_LENGTH];
+    unsigned blcount[MAX_BIT_LENGTH + 1];
     unsigned nextcode[MAX_BIT_LENGTH + 1];
-    unsigned bits, n, i;
-    unsigned nodefilled = 0; /*up to which node it is filled */
-    unsigned treepos = 0;    /*position in the tree (1 of the numcodes columns) */
+    unsigned bits, n;
+    unsigned code = 0, index = 0;
 
     /* initialize local vectors */
     memset(blcount, 0, sizeof(blcount));
-    memset(nextcode, 0, sizeof(nextcode));
+    memset(tree->fast, 0, sizeof(tree->fast));
 
     /*step 1: count number of instances of each code length */
-    for (bits = 0; bits < tree->numcodes; bits++)
+    for (n = 0; n < tree->numcodes; n++)
     {
-        blcount[bitlen[bits]]++;
+        blcount[bitlen[n]]++;
     }
+    blcount[0] = 0;
 
-    /*step 2: generate the nextcode values */
-    for (bits = 1; bits <= tree->maxbitlen; bits++)
+    /*step 2: generate the first code of each length, the codes of one length follow each other */
+    for (bits = 1; bits <= MAX_BIT_LENGTH; bits++)
     {
-        nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-    }
+        nextcode[bits] = code;
+        tree->firstcode[bits] = code;
+        tree->firstsymbol[bits] = index;
 
-    /*step 3: generate all the codes */
-    for (n = 0; n < tree->numcodes; n++)
-    {
-        if (bitlen[n] != 0)
+        code += blcount[bits];
+        index += blcount[bits];
+
+        /* more codes of this length than there are bit patterns, the tree is oversubscribed */
+        if (code > (1u << bits))
         {
-            tree1d[n] = nextcode[bitlen[n]]++;
+            SET_ERROR(upng, UPNG_EMALFORMED);
+            return;
         }
-    }
 
-    /*convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means uninited, a value >= numcodes is an address to another bit, a value < numcodes is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as many columns as codes - 1
-       a good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes. Here, the internal nodes are stored (what their 0 and 1 option point to). There is only memory for such good tree currently, if there are more nodes (due to too long length codes), error 55 will happen */
-    for (n = 0; n < tree->numcodes * 2; n++)
-    {
-        tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet */
+        tree->maxcode[bits] = code << (16 - bits);
+        code <<= 1;
     }
 
+    /*step 3: give every symbol the next code of its length. The codes are sent msb first into an lsb first bit stream, so the fast table is indexed by reversed codes, and every index that starts with a code maps to it */
     for (n = 0; n < tree->numcodes; n++)
-    { /*the codes */
-        for (i = 0; i < bitlen[n]; i++)
-        { /*the bits for this code */
-            unsigned char bit = (unsigned char)((tree1d[n] >> (bitlen[n] - i - 1)) & 1);
-            /* check if oversubscribed */
-            if (treepos > tree->numcodes - 2)
-            {
-                SET_ERROR(upng, UPNG_EMALFORMED);
-                return;
-            }
+    {
+        bits = bitlen[n];
+        if (bits != 0)
+        {
+            tree->symbols[tree->firstsymbol[bits] + nextcode[bits] - tree->firstcode[bits]] = (unsigned short)n;
 
-            if (tree->tree2d[2 * treepos + bit] == 32767)
-            { /*not yet filled in */
-                if (i + 1 == bitlen[n])
-                {                                        /*last bit */
-                    tree->tree2d[2 * treepos + bit] = n; /*put the current code in it */
-                    treepos = 0;
-                }
-                else
-                { /*put address of the next step in here, first that address has to be found of course (it's just nodefilled + 1)... */
-                    nodefilled++;
-                    tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes; /*addresses encoded with numcodes added to it */
-                    treepos = nodefilled;
-                }
-            }
-            else
+            if (bits <= HUFFMAN_FAST_BITS)
             {
-                treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
+                unsigned entry;
+                for (entry = reverse_bits(nextcode[bits], bits); entry < HUFFMAN_FAST_SIZE; entry += 1u << bits)
+                {
+                    tree->fast[entry] = (unsigned short)((bits << HUFFMAN_SYMBOL_BITS) | n);
+                }
             }
-        }
-    }
 
-    for (n = 0; n < tree->numcodes * 2; n++)
-    {
-        if (tree->tree2d[n] == 32767)
-        {
-            tree->tree2d[n] = 0; /*remove possible remaining 32767's */
+            nextcode[bits]++;
         }
     }
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in, unsigned long *bp, const huffman_tree *codetree, unsigned long inlength)
+/*the fixed trees of btype 1 as given by their code lengths in the deflate spec*/
+static void huffman_tree_create_fixed(upng_t *upng, huffman_tree *codetree, huffman_tree *codetreeD)
 {
-    unsigned treepos = 0, ct;
-    unsigned char bit;
-    for (;;)
+    unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
+    unsigned bitlenD[NUM_DISTANCE_SYMBOLS];
+    unsigned n;
+
+    for (n = 0; n < NUM_DEFLATE_CODE_SYMBOLS; n++)
     {
-        /* error: end of input memory reached without endcode */
-        if (((*bp) & 0x07) == 0 && ((*bp) >> 3) > inlength)
-        {
-            SET_ERROR(upng, UPNG_EMALFORMED);
-            return 0;
-        }
+        bitlen[n] = n <= 143 ? 8 : n <= 255 ? 9 : n <= 279 ? 7 : 8;
+    }
+    for (n = 0; n < NUM_DISTANCE_SYMBOLS; n++)
+    {
+        bitlenD[n] = 5;
+    }
 
-        bit = read_bit(bp, in);
+    huffman_tree_create_lengths(upng, codetree, bitlen);
+    huffman_tree_create_lengths(upng, codetreeD, bitlenD);
+}
 
-        ct = codetree->tree2d[(treepos << 1) | bit];
-        if (ct < codetree->numcodes)
+/*at least MAX_BIT_LENGTH bits must be loaded*/
+static unsigned huffman_decode_symbol(upng_t *upng, bit_reader *br, const huffman_tree *codetree)
+{
+    unsigned bits = (unsigned)br->bits & 0xFFFF;
+    unsigned entry = codetree->fast[bits & (HUFFMAN_FAST_SIZE - 1)];
+    unsigned length, symbol;
+
+    if (entry != 0)
+    {
+        length = entry >> HUFFMAN_SYMBOL_BITS;
+        symbol = entry & ((1u << HUFFMAN_SYMBOL_BITS) - 1);
+    }
+    else
+    {
+        /* a longer code, its length is the first whose codes reach past it */
+        unsigned code = reverse_bits(bits, 16);
+        for (length = HUFFMAN_FAST_BITS + 1; length <= MAX_BIT_LENGTH; length++)
         {
-            return ct;
+            if (code < codetree->maxcode[length])
+            {
+                break;
+            }
         }
 
-        treepos = ct - codetree->numcodes;
-        if (treepos >= codetree->numcodes)
+        /* error: no symbol has this code */
+        if (length > MAX_BIT_LENGTH)
         {
             SET_ERROR(upng, UPNG_EMALFORMED);
             return 0;
         }
+
+        symbol = codetree->symbols[(code >> (16 - length)) - codetree->firstcode[length] + codetree->firstsymbol[length]];
     }
+
+    bit_reader_bits(br, length);
+    return symbol;
 }
 
 /* get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffman_tree *codetreeD, huffman_tree *codelengthcodetree, const unsigned char *in, unsigned long *bp, unsigned long inlength)
+static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffman_tree *codetreeD, huffman_tree *codelengthcodetree, bit_reader *br)
 {
     unsigned codelengthcode[NUM_CODE_LENGTH_CODES];
     unsigned bitlen[NUM_DEFLATE_CODE_SYMBOLS];
@@ -327,27 +432,19 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
     unsigned n, hlit, hdist, hclen, i;
 
     /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated */
-    /*C-code note: use no "return" between ctor and dtor of an uivector! */
-    if ((*bp) >> 3 >= inlength - 2)
-    {
-        SET_ERROR(upng, UPNG_EMALFORMED);
-        return;
-    }
-
     /* clear bitlen arrays */
     memset(bitlen, 0, sizeof(bitlen));
     memset(bitlenD, 0, sizeof(bitlenD));
 
-    /*the bit pointer is or will go past the memory */
-    hlit = read_bits(bp, in, 5) + 257; /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
-    hdist = read_bits(bp, in, 5) + 1;  /*number of distance codes. Unlike the spec, the value 1 is added to it here already */
-    hclen = read_bits(bp, in, 4) + 4;  /*number of code length codes. Unlike the spec, the value 4 is added to it here already */
+    hlit = read_bits(upng, br, 5) + 257; /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already */
+    hdist = read_bits(upng, br, 5) + 1;  /*number of distance codes. Unlike the spec, the value 1 is added to it here already */
+    hclen = read_bits(upng, br, 4) + 4;  /*number of code length codes. Unlike the spec, the value 4 is added to it here already */
 
     for (i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
         if (i < hclen)
         {
-            codelengthcode[CLCL[i]] = read_bits(bp, in, 3);
+            codelengthcode[CLCL[i]] = read_bits(upng, br, 3);
         }
         else
         {
@@ -367,7 +464,11 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
     i = 0;
     while (i < hlit + hdist)
     { /*i is the current symbol we're reading in the part that contains the code lengths of lit/len codes and dist codes */
-        unsigned code = huffman_decode_symbol(upng, in, bp, codelengthcodetree, inlength);
+        unsigned code;
+
+        /* enough for a code length code and its extra bits */
+        bit_reader_refill(upng, br);
+        code = huffman_decode_symbol(upng, br, codelengthcodetree);
         if (upng->error != UPNG_EOK)
         {
             break;
@@ -390,13 +491,7 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
             unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6) */
             unsigned value;         /*set value to the previous code */
 
-            if ((*bp) >> 3 >= inlength)
-            {
-                SET_ERROR(upng, UPNG_EMALFORMED);
-                break;
-            }
-            /*error, bit pointer jumps past memory */
-            replength += read_bits(bp, in, 2);
+            replength += bit_reader_bits(br, 2);
 
             if ((i - 1) < hlit)
             {
@@ -431,14 +526,7 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
         else if (code == 17)
         {                           /*repeat "0" 3-10 times */
             unsigned replength = 3; /*read in the bits that indicate repeat length */
-            if ((*bp) >> 3 >= inlength)
-            {
-                SET_ERROR(upng, UPNG_EMALFORMED);
-                break;
-            }
-
-            /*error, bit pointer jumps past memory */
-            replength += read_bits(bp, in, 3);
+            replength += bit_reader_bits(br, 3);
 
             /*repeat this value in the next lengths */
             for (n = 0; n < replength; n++)
@@ -464,14 +552,7 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
         else if (code == 18)
         {                            /*repeat "0" 11-138 times */
             unsigned replength = 11; /*read in the bits that indicate repeat length */
-            /* error, bit pointer jumps past memory */
-            if ((*bp) >> 3 >= inlength)
-            {
-                SET_ERROR(upng, UPNG_EMALFORMED);
-                break;
-            }
-
-            replength += read_bits(bp, in, 7);
+            replength += bit_reader_bits(br, 7);
 
             /*repeat this value in the next lengths */
             for (n = 0; n < replength; n++)
@@ -515,36 +596,43 @@ static void get_tree_inflate_dynamic(upng_t *upng, huffman_tree *codetree, huffm
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static void inflate_huffman(upng_t *upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength, unsigned btype)
+static void inflate_huffman(upng_t *upng, unsigned char *out, unsigned long outsize, bit_reader *br, unsigned long *pos, unsigned btype)
 {
-    unsigned codetree_buffer[DEFLATE_CODE_BUFFER_SIZE];
-    unsigned codetreeD_buffer[DISTANCE_BUFFER_SIZE];
     unsigned done = 0;
 
     huffman_tree codetree;
     huffman_tree codetreeD;
 
+    huffman_tree_init(&codetree, NUM_DEFLATE_CODE_SYMBOLS);
+    huffman_tree_init(&codetreeD, NUM_DISTANCE_SYMBOLS);
+
     if (btype == 1)
     {
         /* fixed trees */
-        huffman_tree_init(&codetree, (unsigned *)FIXED_DEFLATE_CODE_TREE, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-        huffman_tree_init(&codetreeD, (unsigned *)FIXED_DISTANCE_TREE, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
+        huffman_tree_create_fixed(upng, &codetree, &codetreeD);
     }
     else if (btype == 2)
     {
         /* dynamic trees */
-        unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
         huffman_tree codelengthcodetree;
 
-        huffman_tree_init(&codetree, codetree_buffer, NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
-        huffman_tree_init(&codetreeD, codetreeD_buffer, NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
-        huffman_tree_init(&codelengthcodetree, codelengthcodetree_buffer, NUM_CODE_LENGTH_CODES, CODE_LENGTH_BITLEN);
-        get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, in, bp, inlength);
+        huffman_tree_init(&codelengthcodetree, NUM_CODE_LENGTH_CODES);
+        get_tree_inflate_dynamic(upng, &codetree, &codetreeD, &codelengthcodetree, br);
+    }
+
+    /* the trees are incomplete after an error */
+    if (upng->error != UPNG_EOK)
+    {
+        return;
     }
 
     while (done == 0)
     {
-        unsigned code = huffman_decode_symbol(upng, in, bp, &codetree, inlength);
+        unsigned code;
+
+        /* one refill covers a whole length and distance pair */
+        bit_reader_refill(upng, br);
+        code = huffman_decode_symbol(upng, br, &codetree);
         if (upng->error != UPNG_EOK)
         {
             return;
@@ -576,17 +664,10 @@ static void inflate_huffman(upng_t *upng, unsigned char *out, unsigned long outs
 
             /* part 2: get extra bits and add the value of that to length */
             numextrabits = LENGTH_EXTRA[code - FIRST_LENGTH_CODE_INDEX];
-
-            /* error, bit pointer will jump past memory */
-            if (((*bp) >> 3) >= inlength)
-            {
-                SET_ERROR(upng, UPNG_EMALFORMED);
-                return;
-            }
-            length += read_bits(bp, in, numextrabits);
+            length += bit_reader_bits(br, numextrabits);
 
             /*part 3: get distance code */
-            codeD = huffman_decode_symbol(upng, in, bp, &codetreeD, inlength);
+            codeD = huffman_decode_symbol(upng, br, &codetreeD);
             if (upng->error != UPNG_EOK)
             {
                 return;
@@ -603,64 +684,50 @@ static void inflate_huffman(upng_t *upng, unsigned char *out, unsigned long outs
 
             /*part 4: get extra bits from distance */
             numextrabitsD = DISTANCE_EXTRA[codeD];
+            distance += bit_reader_bits(br, numextrabitsD);
 
-            /* error, bit pointer will jump past memory */
-            if (((*bp) >> 3) >= inlength)
+            /*part 5: fill in all the out[n] values based on the length and dist */
+            start = (*pos);
+            backward = start - distance;
+
+            /* error, distance points before the start of the output */
+            if (distance > start)
             {
                 SET_ERROR(upng, UPNG_EMALFORMED);
                 return;
             }
 
-            distance += read_bits(bp, in, numextrabitsD);
-
-            /*part 5: fill in all the out[n] values based on the length and dist */
-            start = (*pos);
-            backward = start - distance;
-
             if ((*pos) + length >= outsize)
             {
                 SET_ERROR(upng, UPNG_EMALFORMED);
                 return;
             }
 
+            /* copied forward one byte at a time, so a distance shorter than the length repeats the bytes it just wrote */
             for (forward = 0; forward < length; forward++)
             {
-                out[(*pos)++] = out[backward];
-                backward++;
-
-                if (backward >= start)
-                {
-                    backward = start - distance;
-                }
+                out[(*pos)++] = out[backward++];
             }
         }
     }
 }
 
-static void inflate_uncompressed(upng_t *upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long *bp, unsigned long *pos, unsigned long inlength)
+static void inflate_uncompressed(upng_t *upng, unsigned char *out, unsigned long outsize, bit_reader *br, unsigned long *pos)
 {
-    unsigned long p;
-    unsigned len, nlen, n;
+    unsigned len, nlen;
 
     /* go to first boundary of byte */
-    while (((*bp) & 0x7) != 0)
-    {
-        (*bp)++;
-    }
-    p = (*bp) / 8; /*byte position */
+    bit_reader_bits(br, br->count & 0x7);
 
     /* read len (2 bytes) and nlen (2 bytes) */
-    if (p >= inlength - 4)
+    len = read_bits(upng, br, 16);
+    nlen = read_bits(upng, br, 16);
+    if (bit_reader_overrun(br))
     {
         SET_ERROR(upng, UPNG_EMALFORMED);
         return;
     }
 
-    len = in[p] + 256 * in[p + 1];
-    p += 2;
-    nlen = in[p] + 256 * in[p + 1];
-    p += 2;
-
     /* check if 16-bit nlen is really the one's complement of len */
     if (len + nlen != 65535)
     {
@@ -675,24 +742,13 @@ static void inflate_uncompressed(upng_t *upng, unsigned char *out, unsigned long
     }
 
     /* read the literal data: len bytes are now stored in the out buffer */
-    if (p + len > inlength)
-    {
-        SET_ERROR(upng, UPNG_EMALFORMED);
-        return;
-    }
-
-    for (n = 0; n < len; n++)
-    {
-        out[(*pos)++] = in[p++];
-    }
-
-    (*bp) = p * 8;
+    bit_reader_copy(upng, br, out + (*pos), len);
+    (*pos) += len;
 }
 
 /*inflate the deflated data (cfr. deflate spec); return value is the error*/
-static upng_error uz_inflate_data(upng_t *upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long insize, unsigned long inpos)
+static upng_error uz_inflate_data(upng_t *upng, unsigned char *out, unsigned long outsize, bit_reader *br)
 {
-    unsigned long bp = 0;  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte) */
     unsigned long pos = 0; /*byte position in the out buffer */
 
     unsigned done = 0;
@@ -701,16 +757,9 @@ static upng_error uz_inflate_data(upng_t *upng, unsigned char *out, unsigned lon
     {
         unsigned btype;
 
-        /* ensure next bit doesn't point past the end of the buffer */
-        if ((bp >> 3) >= insize)
-        {
-            SET_ERROR(upng, UPNG_EMALFORMED);
-            return upng->error;
-        }
-
         /* read block control bits */
-        done = read_bit(&bp, &in[inpos]);
-        btype = read_bit(&bp, &in[inpos]) | (read_bit(&bp, &in[inpos]) << 1);
+        done = read_bits(upng, br, 1);
+        btype = read_bits(upng, br, 2);
 
         /* process control type appropriateyly */
         if (btype == 3)
@@ -720,11 +769,11 @@ static upng_error uz_inflate_data(upng_t *upng, unsigned char *out, unsigned lon
         }
         else if (btype == 0)
         {
-            inflate_uncompressed(upng, out, outsize, &in[inpos], &bp, &pos, insize); /*no compression */
+            inflate_uncompressed(upng, out, outsize, br, &pos); /*no compression */
         }
         else
         {
-            inflate_huffman(upng, out, outsize, &in[inpos], &bp, &pos, insize, btype); /*compression, btype 01 or 10 */
+            inflate_huffman(upng, out, outsize, br, &pos, btype); /*compression, btype 01 or 10 */
         }
 
         /* stop if an error has occured */
@@ -734,13 +783,27 @@ static upng_error uz_inflate_data(upng_t *upng, unsigned char *out, unsigned lon
         }
     }
 
+    /* error: the blocks ended in the zeros loaded past the end of the data */
+    if (bit_reader_overrun(br))
+    {
+        SET_ERROR(upng, UPNG_EMALFORMED);
+    }
+
     return upng->error;
 }
 
-static upng_error uz_inflate(upng_t *upng, unsigned char *out, unsigned long outsize, const unsigned char *in, unsigned long insize)
+/*inflate the zlib data in the payloads of the IDAT chunks from chunk on, up to end*/
+static upng_error uz_inflate(upng_t *upng, unsigned char *out, unsigned long outsize, const unsigned char *chunk, const unsigned char *end)
 {
+    bit_reader br;
+    unsigned in[2]; /*the zlib data header */
+
+    bit_reader_init(&br, chunk, end);
+    in[0] = read_bits(upng, &br, 8);
+    in[1] = read_bits(upng, &br, 8);
+
     /* we require two bytes for the zlib data header */
-    if (insize < 2)
+    if (upng->error != UPNG_EOK || bit_reader_overrun(&br))
     {
         SET_ERROR(upng, UPNG_EMALFORMED);
         return upng->error;
@@ -768,7 +831,7 @@ static upng_error uz_inflate(upng_t *upng, unsigned char *out, unsigned long out
     }
 
     /* create output buffer */
-    uz_inflate_data(upng, out, outsize, in, insize, 2);
+    uz_inflate_data(upng, out, outsize, &br);
 
     return upng->error;
 }
@@ -1097,9 +1160,9 @@ upng_error upng_header(upng_t *upng)
 upng_error upng_decode(upng_t *upng)
 {
     const unsigned char *chunk;
-    unsigned char *compressed;
+    const unsigned char *idat = NULL; /*the first IDAT chunk */
+    const unsigned char *end = upng->source.buffer + upng->source.size;
     unsigned char *inflated;
-    unsigned long compressed_size = 0, compressed_index = 0;
     unsigned long inflated_size;
     upng_error error;
 
@@ -1133,12 +1196,12 @@ upng_error upng_decode(upng_t *upng)
     /* first byte of the first chunk after the header */
     chunk = upng->source.buffer + 33;
 
-    /* scan through the chunks, finding the size of all IDAT chunks, and also
-     * verify general well-formed-ness */
-    while (chunk < upng->source.buffer + upng->source.size)
+    /* scan through the chunks, finding the first IDAT chunk, and also
+     * verify general well-formed-ness. the image data is inflated in place
+     * from the IDAT chunks, which can't run past the source after this */
+    while (chunk < end)
     {
         unsigned long length;
-        const unsigned char *data; /*the data in the chunk */
 
         /* make sure chunk header is not larger than the total compressed */
         if ((unsigned long)(chunk - upng->source.buffer + 12) > upng->source.size)
@@ -1162,13 +1225,13 @@ upng_error upng_decode(upng_t *upng)
             return upng->error;
         }
 
-        /* get pointer to payload */
-        data = chunk + 8;
-
         /* parse chunks */
         if (upng_chunk_type(chunk) == CHUNK_IDAT)
         {
-            compressed_size += length;
+            if (idat == NULL)
+            {
+                idat = chunk;
+            }
         }
         else if (upng_chunk_type(chunk) == CHUNK_IEND)
         {
@@ -1183,61 +1246,30 @@ upng_error upng_decode(upng_t *upng)
         chunk += upng_chunk_length(chunk) + 12;
     }
 
-    /* allocate enough space for the (compressed and filtered) image data */
-    compressed = (unsigned char *)malloc(compressed_size);
-    if (compressed == NULL)
+    /* error: no image data */
+    if (idat == NULL)
     {
-        SET_ERROR(upng, UPNG_ENOMEM);
+        SET_ERROR(upng, UPNG_EMALFORMED);
         return upng->error;
     }
 
-    /* scan through the chunks again, this time copying the values into
-     * our compressed buffer.  there's no reason to validate anything a second time. */
-    chunk = upng->source.buffer + 33;
-    while (chunk < upng->source.buffer + upng->source.size)
-    {
-        unsigned long length;
-        const unsigned char *data; /*the data in the chunk */
-
-        length = upng_chunk_length(chunk);
-        data = chunk + 8;
-
-        /* parse chunks */
-        if (upng_chunk_type(chunk) == CHUNK_IDAT)
-        {
-            memcpy(compressed + compressed_index, data, length);
-            compressed_index += length;
-        }
-        else if (upng_chunk_type(chunk) == CHUNK_IEND)
-        {
-            break;
-        }
-
-        chunk += upng_chunk_length(chunk) + 12;
-    }
-
     /* allocate space to store inflated (but still filtered) data */
     inflated_size = ((upng->width * (upng->height * upng_get_bpp(upng) + 7)) / 8) + upng->height;
     inflated = (unsigned char *)malloc(inflated_size);
     if (inflated == NULL)
     {
-        free(compressed);
         SET_ERROR(upng, UPNG_ENOMEM);
         return upng->error;
     }
 
     /* decompress image data */
-    error = uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
+    error = uz_inflate(upng, inflated, inflated_size, idat, end);
     if (error != UPNG_EOK)
     {
-        free(compressed);
         free(inflated);
         return upng->error;
     }
 
-    /* free the compressed compressed data */
-    free(compressed);
-
     /* allocate final image buffer */
     upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
     upng->buffer = (unsigned char *)malloc(upng->size);
@@ -177,3 +177,16 @@ vec4_t vec4_from_vec3(vec3_t v)
 
     return result;
 }
+
+vec4_t vec4_perspective_divide(vec4_t v)
+{
+    // Divide by w but keep w itself, it is needed for perspective correct interpolation
+    if (v.w != 0.0)
+    {
+        v.x /= v.w;
+        v.y /= v.w;
+        v.z /= v.w;
+    }
+
+    return v;
+}
@@ -55,5 +55,6 @@ vec3_t vec3_from_vec4(vec4_t v);
  * Vector 4D functions
  */
 vec4_t vec4_from_vec3(vec3_t v);
+vec4_t vec4_perspective_divide(vec4_t v);
 
 #endif
\ No newline at end of file